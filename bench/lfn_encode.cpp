@@ -0,0 +1,82 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fat.hpp>
+
+// Times the long name path every file and directory takes: the short name alias and the
+// directory entries with their UTF-16 slices, for generated names of 5 to 120 characters
+// of which every eighth is not plain ASCII
+// Usage: lfn_encode [name count]
+
+#define NAMES_PER_DIRECTORY 1000
+
+static std::vector<std::string> getNames(size_t count)
+{
+    static char const *const words[] = { "report", "Backup", "holiday photo", "build-output", "config.old", "Übersicht", "данные", "日本語" };
+    std::vector<std::string> names;
+    names.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        std::string name = i % 8 == 5 ? words[5 + (i / 8) % 3] : words[i % 5];
+        for (size_t j = 0; j < (i / 5) % 12; j++)
+            name += j % 2 ? " part" : "_0123456";
+        name += " " + std::to_string(i) + (i % 3 ? ".txt" : ".tar.gz");
+        names.push_back(std::move(name));
+    }
+    return names;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::vector<std::string> names = getNames(count);
+
+    // The encoder doesn't touch the image, an unopened one is enough
+    GptPartition partition = {};
+    BasicFat<SECTOR_SIZE_512> fat(std::string(), partition);
+    std::pair<FATDATE, FATTIME> dateTime = {};
+
+    std::vector<std::string> shortNames(count);
+    std::vector<bool> longNames(count);
+    std::vector<BYTE> caseFlags(count);
+    auto start = std::chrono::steady_clock::now();
+    FatDirectoryNames directoryNames;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i % NAMES_PER_DIRECTORY == 0)
+            directoryNames = FatDirectoryNames();
+        bool isLongName;
+        if (!BasicFat<SECTOR_SIZE_512>::getUniqueShortName(directoryNames, names[i], shortNames[i], isLongName, caseFlags[i]))
+        {
+            std::cerr << "no short name for " << names[i] << std::endl;
+            return 1;
+        }
+        longNames[i] = isLongName;
+    }
+    auto aliased = std::chrono::steady_clock::now();
+
+    QWORD entryBytes = 0;
+    DWORD checkSum = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        DWORD bufferSize;
+        auto buffer = fat.getDirectoryEntry(names[i], shortNames[i], longNames[i], caseFlags[i], false, 2, 0, dateTime, bufferSize);
+        if (!buffer)
+        {
+            std::cerr << "can't encode " << names[i] << std::endl;
+            return 1;
+        }
+        entryBytes += bufferSize;
+        checkSum += buffer[0] + buffer[bufferSize - 32];
+    }
+    auto encoded = std::chrono::steady_clock::now();
+
+    auto nanoseconds = [count](auto from, auto to) { return std::chrono::duration<double, std::nano>(to - from).count() / count; };
+    std::cout << count << " names, " << entryBytes / 32 << " directory entries (checksum " << checkSum << ")" << std::endl;
+    std::cout << "short names: " << nanoseconds(start, aliased) << " ns per name" << std::endl;
+    std::cout << "directory entries: " << nanoseconds(aliased, encoded) << " ns per name" << std::endl;
+    return 0;
+}
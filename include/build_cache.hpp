@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+
+#include <cal_types.h>
+#include <config.hpp>
+
+class BuildCache
+{
+    private:
+        std::string directory;
+        QWORD sizeLimit;
+        QWORD hits;
+        QWORD misses;
+        QWORD bytesSaved;
+
+        std::string getEntryPath(QWORD key);
+        void loadStatistics();
+        void saveStatistics();
+        void evict();
+
+    public:
+        BuildCache(std::string const& cacheDirectory, QWORD cacheSizeLimit);
+
+        bool computeKey(Configuration const& config, QWORD &key);
+        bool fetch(QWORD key, std::string const& outputPath);
+        bool store(QWORD key, std::string const& outputPath);
+        void printStatistics();
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <optional>
+
+#include <gpt.hpp>
+#include <json.hpp>
+
+typedef struct
+{
+    std::string Source; // Empty for a preallocated file
+    std::string Destination;
+    std::optional<DWORD> Priority; // Boot order, placed at the start of the data region
+    std::optional<QWORD> Size; // Of the source, filled in by the pre-flight checks. Given for a preallocated file
+    std::optional<BYTE> Fill; // Written over a preallocated file, which reads as zero otherwise
+} ConfigurationFile;
+
+typedef struct
+{
+    std::string Source; // Host directory whose tree is imported
+    std::string Destination; // Existing directory of the filesystem
+    std::vector<std::string> Include; // Globs a file must match one of, every file when empty
+    std::vector<std::string> Exclude; // Globs of files and directories left out
+} ConfigurationSourceDirectory;
+
+typedef struct
+{
+    std::string Source; // tar archive, "-" reads it from stdin
+    std::string Destination; // Existing directory of the filesystem
+    std::vector<std::string> Directories; // Found by the pre-flight scan, stdin isn't scanned
+    std::vector<ConfigurationFile> Files; // Found by the pre-flight scan, with their size
+} ConfigurationArchive;
+
+typedef struct
+{
+    std::string Partition;
+    std::vector<std::string> Directories;
+    std::vector<ConfigurationFile> Files;
+    std::vector<ConfigurationSourceDirectory> SourceDirectories; // Walked into Directories and Files before the build
+    std::vector<ConfigurationArchive> Archives; // Streamed into the filesystem after the listed files
+    DWORD ClusterSize; // Bytes, 0 picks it from the partition size
+    bool OptimizeClusterSize; // Picked from the sizes of the files instead
+} ConfigurationFilesystem;
+
+typedef struct
+{
+    std::string Partition;
+    std::string Source;
+    std::string Destination;
+} ConfigurationVariantFile;
+
+typedef struct
+{
+    std::string Output;
+    std::vector<ConfigurationVariantFile> Files; // Replace files of the base image
+} ConfigurationVariant;
+
+typedef struct
+{
+    std::string Output;
+    std::vector<std::string> ExtraOutputs; // Receive a copy of the finished image
+    std::vector<ConfigurationParitition> Partitions;
+    std::vector<ConfigurationFilesystem> Filesystems;
+    std::vector<ConfigurationVariant> Variants;
+    bool Reproducible;
+    std::string Seed; // GUIDs are derived from it in reproducible builds
+    std::optional<INT64> SourceDateEpoch; // Timestamp of every entry in reproducible builds
+    DWORD SectorSize; // SECTOR_SIZE_512 or SECTOR_SIZE_4K
+    QWORD Alignment; // Partition starts, in bytes
+    DWORD EraseBlockSize; // FAT data regions and large files start on these boundaries, 0 disables it
+} Configuration;
+
+int parseConfiguration(nlohmann::json const& jsonConfig, Configuration &config);
+int loadConfiguration(std::string const& path, Configuration &config);
+QWORD hashConfiguration(Configuration const& config);
@@ -1,7 +1,11 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <span>
+#include <ctime>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <optional>
 #include <fstream>
@@ -10,8 +14,63 @@
 #include <fat_types.hpp>
 #include <gpt.hpp>
 #include <memory_map.hpp>
+#include <source_cache.hpp>
 
-class Fat
+typedef struct
+{
+    DWORD FirstCluster;
+    DWORD Size;
+    QWORD EntryOffset; // Offset of the short DIR_ENTRY from the start of the partition
+} FatFilePlacement;
+
+typedef struct
+{
+    std::string_view Destination;
+    std::string_view Source; // Empty for a preallocated file, which has a Size instead
+    std::optional<DWORD> Priority; // Placed ahead of other files, lowest value first
+    std::optional<QWORD> Size; // Size of the source when already known, looked up otherwise
+    std::optional<BYTE> Fill; // Written over a preallocated file, its clusters are left as holes otherwise
+} FatFileSpec;
+
+typedef struct
+{
+    DWORD ClusterSize; // bytes
+    DWORD ClusterCount;
+    DWORD ReservedSectors;
+    DWORD FatSectors; // per FAT
+    QWORD Files;
+    QWORD Directories; // The root included
+    QWORD FileClusters;
+    QWORD DirectoryClusters;
+    QWORD PaddingClusters; // At most this many are skipped to align large files
+    QWORD FreeClusters;
+    QWORD Slack; // bytes
+    QWORD FileBytes;
+    QWORD BytesWritten; // Headers, FAT entries in use, directories and file data
+    bool Fits;
+} FatLayoutEstimate;
+
+// Names in use in one directory, the pre-flight checks keep them the same way to find clashing aliases
+typedef struct
+{
+    std::unordered_set<std::string> ShortNames; // 11 character names in use
+    std::unordered_set<std::string> LongNames; // Upper case
+    std::unordered_map<std::string, DWORD> NextTail; // Next ~N to try per basis
+} FatDirectoryNames;
+
+// Long names match ignoring (ASCII) case, so do paths made of them
+struct FatNameHash
+{
+    size_t operator()(std::string_view name) const;
+};
+
+struct FatNameEqual
+{
+    bool operator()(std::string_view a, std::string_view b) const;
+};
+
+template <DWORD SectorSize>
+class BasicFat
 {
     private:
         struct FatRawDirectory
@@ -24,7 +83,17 @@ class Fat
         struct FatDirectory
         {
             FatRawDirectory rawDirectory;
-            std::unordered_map<std::string, FatDirectory> children; 
+            DWORD parent; // Index of the parent directory
+            DWORD name; // Interned name
+            FatDirectoryNames names;
+        };
+
+        struct FatPathStatistics
+        {
+            QWORD lookups;
+            QWORD components;
+            QWORD cacheHits;
+            QWORD nanoseconds;
         };
 
         std::string destination;
@@ -38,6 +107,7 @@ class Fat
         std::fstream os;
         GptPartition partition;
         DWORD maxDirEntries;
+        BYTE *imageStart;
         BYTE *partitionStart;
         BYTE *firstFsInfo;
         BYTE *secondFsInfo;
@@ -47,32 +117,91 @@ class Fat
         DWORD freeClusterCount;
         BYTE *dataStart;
         MemoryMappedFile file;
-        FatDirectory rootDirectory;
+        bool reproducible;
+        std::optional<std::time_t> fixedTimestamp;
+        SourceCache *sourceCache;
+        std::unordered_map<std::string, FatFilePlacement> filePlacements;
+        std::vector<FatDirectory> directories; // Index 0 is the root directory
+        std::unordered_map<QWORD, DWORD> directoryChildren; // (parent index << 32 | interned name) -> directory index
+        std::unordered_map<std::string_view, DWORD, FatNameHash, FatNameEqual> internedNames; // Views into nameBlocks, names differing in case share one
+        std::vector<std::unique_ptr<char[]>> nameBlocks;
+        DWORD nameBlockUsed;
+        QWORD nameBytes;
+        std::string lastParentPath;
+        DWORD lastParent;
+        FatPathStatistics pathStatistics;
+        std::unordered_map<std::string, DWORD> reservedDirectoryClusters; // Path without the leading slash -> first cluster
+        std::unordered_map<std::string, std::pair<DWORD, DWORD>> reservedFileClusters; // Destination -> first cluster and cluster count
+        DWORD reservedClusterCount; // Set aside for priority files but not allocated yet
+        DWORD clusterEnd; // One past the last data cluster
+        DWORD eraseBlockSize;
+        DWORD requestedClusterSize; // Bytes, 0 picks it from the partition size
 
-        DWORD computeFatSizeInSectors();
+        static DWORD computeFatSizeInSectors(QWORD lbaCount, DWORD reservedSectors, DWORD clusterSectors);
+        DWORD getDefaultSectorsPerCluster();
+        bool computeGeometry(DWORD clusterSectors, DWORD &reservedSectors, DWORD &fatSectors, DWORD &clusterCount);
         std::unique_ptr<FAT_BPB> getFatBiosParameterBlock();
         std::unique_ptr<FSINFO> getFatFsInfo();
         DWORD getFirstSectorOfCluster(DWORD cluster);
         void writeToFatEntry(DWORD fatTable, DWORD fatEntry, DWORD value);
         void writeToSector(DWORD sector, BYTE* buffer, DWORD size);
         void createRootDirectory();
+        std::pair<FATDATE, FATTIME> getDateAndTime(std::time_t timestamp);
         std::pair<FATDATE, FATTIME> getCurrentDateAndTime();
-        std::unique_ptr<BYTE[]> getDirectoryEntry(std::string const& name, bool directory, DWORD firstCluster, DWORD size, std::optional<std::pair<FATDATE, FATTIME>> const& dateTime, DWORD &bufferSize);
+        std::pair<FATDATE, FATTIME> getFileDateAndTime(std::string const& sourcePath);
         DWORD allocateClusters(DWORD previousCluster, DWORD clusterCount);
+        DWORD allocateFreeClusters(DWORD previousCluster, DWORD clusterCount);
+        bool isContiguousChain(DWORD firstCluster, DWORD clusterCount);
+        DWORD allocateFileClusters(DWORD clusterCount, std::pair<DWORD, DWORD> const *reservation);
+        void freeClusterChain(DWORD cluster);
+        DWORD resizeClusterChain(DWORD firstCluster, DWORD clusterCount);
         BYTE *getPointerToCluster(DWORD cluster);
-        std::pair<DWORD, DWORD> writeFile(std::string const& sourcePath);
-        bool writeDirectoryEntries(FatRawDirectory &directory, std::unique_ptr<BYTE[]> &entryBuffer, DWORD entryBufferSize);
-        bool createRawFile(FatRawDirectory &directory, std::string const& filename, std::string const& sourcePath);
-        std::optional<FatRawDirectory> createRawDirectory(FatRawDirectory &parent, std::string const& directoryName);
-        FatDirectory* findDirectory(std::string const& path);
+        void mapFilesystem(BYTE *ptr);
+        void writeFileData(std::istream &in, DWORD firstCluster, DWORD fileSize);
+        bool copyCachedSource(SourceCacheEntry const& entry, BYTE *target);
+        std::pair<DWORD, DWORD> writeFile(std::string const& sourcePath, std::pair<DWORD, DWORD> const *reservation = nullptr);
+        std::pair<DWORD, DWORD> preallocateFile(DWORD fileSize, std::optional<BYTE> fill, std::pair<DWORD, DWORD> const *reservation);
+        bool writeDirectoryEntries(FatRawDirectory &directory, std::unique_ptr<BYTE[]> &entryBuffer, DWORD entryBufferSize, std::vector<DWORD> *clusters = nullptr);
+        bool writeFileEntry(FatDirectory &parent, std::string_view filename, std::string const& shortName, bool isLongName, BYTE caseFlags, std::pair<DWORD, DWORD> loadedFile, std::pair<FATDATE, FATTIME> const& dateTime, FatFilePlacement &placement);
+        bool createRawFile(FatDirectory &parent, std::string_view filename, std::string const& sourcePath, FatFilePlacement &placement);
+        std::optional<FatRawDirectory> createRawDirectory(FatDirectory &parentDirectory, std::string_view directoryName, DWORD reservedCluster = UINT32_MAX);
+        void getChainFragmentation(DWORD firstCluster, QWORD &clusters, QWORD &fragments);
+        DWORD internName(std::string_view name);
+        DWORD findDirectory(std::string_view path);
+        DWORD findParentDirectory(std::string_view path, std::string_view &name);
 
     public:
-        Fat(std::string const &outputPath, GptPartition const &partition);
+        BasicFat(std::string const &outputPath, GptPartition const &partition);
 
-        void createFilesystem();
+        void setReproducible(std::optional<std::time_t> timestamp);
+        void setSourceCache(SourceCache *cache);
+        void setEraseBlockSize(DWORD size);
+        void setClusterSize(DWORD size);
+        std::optional<DWORD> optimizeClusterSize(std::span<std::string const> directoryPaths, std::span<FatFileSpec const> files, bool report = true);
+        bool estimateLayout(std::span<std::string const> directoryPaths, std::span<FatFileSpec const> files, FatLayoutEstimate &estimate);
+        static bool isValidName(std::string_view name);
+        static bool getUniqueShortName(FatDirectoryNames &names, std::string_view name, std::string &shortName, bool &isLongName, BYTE &caseFlags);
+        std::unique_ptr<BYTE[]> getDirectoryEntry(std::string_view name, std::string const& shortName, bool isLongName, BYTE caseFlags, bool directory, DWORD firstCluster, DWORD size, std::optional<std::pair<FATDATE, FATTIME>> const& dateTime, DWORD &bufferSize);
+        static bool planFilesystem(std::span<std::string const> directoryPaths, std::span<FatFileSpec const> files, DWORD headroom, DWORD eraseBlockSize, DWORD &clusterSize, QWORD &lbaCount);
+        bool createFilesystem();
         void openFilesystem();
+        bool loadFilesystem();
+        QWORD shrinkFilesystem();
+        void syncFilesystem();
         void closeFilesystem();
+        void printStatistics();
+        bool reserveLayout(std::span<std::string const> directoryPaths, std::span<FatFileSpec const> files);
         bool createDirectory(std::string const& path);
         bool createFile(std::string const& destinationPath, std::string const& sourcePath);
+        bool createFile(std::string const& destinationPath, std::istream &in, DWORD size, std::time_t modificationTime);
+        bool duplicateFile(std::string const& destinationPath, std::string const& existingPath, std::time_t modificationTime);
+        bool ensureDirectory(std::string const& path);
+        bool createFiles(std::span<FatFileSpec const> files);
+        std::optional<FatFilePlacement> getFilePlacement(std::string const& destinationPath);
+        bool replaceFile(FatFilePlacement &placement, std::string const& sourcePath);
+        void touchFile(FatFilePlacement const& placement, std::string const& sourcePath);
+        bool updateFile(std::string const& destinationPath, std::string const& sourcePath);
 };
 
+typedef BasicFat<SECTOR_SIZE_512> Fat;
+typedef BasicFat<SECTOR_SIZE_4K> Fat4K;
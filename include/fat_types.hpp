@@ -18,6 +18,10 @@
 #define        ATTR_LONG_NAME               (ATTR_READ_ONLY|ATTR_HIDDEN|ATTR_SYSTEM|ATTR_VOLUME_ID)
 #define        ATTR_LONG_NAME_MASK          (ATTR_READ_ONLY|ATTR_HIDDEN|ATTR_SYSTEM|ATTR_VOLUME_ID|ATTR_DIRECTORY|ATTR_ARCHIVE)
 
+// DIR_NTRes flags, the base or extension of the short name is displayed in lower case
+#define        NTRES_LOWER_CASE_BASE        0x08
+#define        NTRES_LOWER_CASE_EXT         0x10
+
 // Short Directory entry name length
 #define        SHORT_NAME_NAME              8
 #define        SHORT_NAME_EXT               3
@@ -102,6 +106,7 @@
 // Maximum number of clusters per FAT type
 #define        FAT12_MAX_CLUSTERS           4085
 #define        FAT16_MAX_CLUSTERS           65525
+#define        FAT32_MAX_CLUSTERS           0x0FFFFFF5
 
 //typedef     WORD    FAT16_ENTRY;
 typedef     DWORD   FAT32_ENTRY;
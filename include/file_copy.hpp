@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+#include <cal_types.h>
+
+bool cloneFile(std::string const& source, std::string const& destination);
+bool copyFile(std::string const& source, std::string const& destination);
+bool placeFile(std::string const& source, std::string const& destination, QWORD offset);
+QWORD getAllocatedSize(std::string const& path);
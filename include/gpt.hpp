@@ -9,13 +9,21 @@
 
 #include <gpt_types.hpp>
 
-#define SECTOR_SIZE 512
+// Logical sector sizes the disk and filesystem code is built for
+#define SECTOR_SIZE_512 512
+#define SECTOR_SIZE_4K 4096
+
+// Partitions start on 1 MiB boundaries unless configured otherwise
+#define DEFAULT_PARTITION_ALIGNMENT (1024 * 1024)
 
 typedef struct
 {
     EFI_GUID Type; 
-    QWORD LBACount;
+    QWORD Size; // In bytes
     std::u16string PartitionName;
+    std::optional<DWORD> Headroom; // Percent, the size is planned from the content of its filesystem when set
+    std::string Content; // Image placed at the start of the partition, empty leaves it zeroed
+    std::optional<QWORD> ContentSize; // Filled in by the pre-flight checks
 } ConfigurationParitition;
 
 typedef struct
@@ -28,7 +36,8 @@ typedef struct
     std::u16string PartitionName;
 } GptPartition;
 
-class GptDisk
+template <DWORD SectorSize>
+class BasicGptDisk
 {
     private:
         std::vector<GptPartition> gptPartitions;
@@ -44,20 +53,32 @@ class GptDisk
         EFI_LBA last;
         DWORD gptHeaderSize;
         DWORD partitionEntrySize;
-        bool diskCreated;
+        bool diskConfigured; // The layout is known, it is only written by createDisk
+        std::optional<std::string> uuidSeed;
+        QWORD alignmentLBAs;
 
-        EFI_GUID generateUuid();
+        EFI_GUID generateUuid(std::string const& name);
         std::unique_ptr<MASTER_BOOT_RECORD> getGptProtectiveMbr();
         std::unique_ptr<EFI_PARTITION_ENTRY> getEfiPartitionEntry(GptPartition const& partition);
         std::unique_ptr<EFI_PARTITION_TABLE_HEADER> getInitialEfiPartitionTableHeader();
         BYTE* generatePartitionTable();
+        void setLastUsable(EFI_LBA lba);
 
     public:
-        GptDisk(std::string const& outputPath);
+        BasicGptDisk(std::string const& outputPath);
 
+        void setSeed(std::string const& seed);
+        void setAlignment(QWORD alignment);
         void configureDisk(std::vector<ConfigurationParitition> const& config);
         void createDisk();
+        bool loadDisk();
+        bool resizeLastPartition(QWORD lbaCount);
         std::optional<GptPartition> getPartition(std::u16string const& partitionName);
+        std::optional<GptPartition> getLastPartition();
         std::optional<QWORD> getDiskSize();
+        QWORD getMetadataSize();
 
 };
+
+typedef BasicGptDisk<SECTOR_SIZE_512> GptDisk;
+typedef BasicGptDisk<SECTOR_SIZE_4K> GptDisk4K;
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <string>
+
+#include "cal_types.h"
+
+QWORD computeHash64(BYTE const *Data, QWORD Length, QWORD Seed = 0);
+bool computeFileHash64(std::string const& path, QWORD &hash);
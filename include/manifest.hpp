@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cal_types.h>
+#include <fat.hpp>
+
+typedef struct
+{
+    std::string Source;
+    std::string Destination;
+    QWORD Size;
+    INT64 ModificationTime;
+    QWORD Hash;
+    FatFilePlacement Placement;
+} ManifestFile;
+
+typedef struct
+{
+    std::string Partition;
+    QWORD StartingLBA;
+    QWORD LBACount;
+    std::vector<ManifestFile> Files;
+} ManifestFilesystem;
+
+typedef struct
+{
+    QWORD ConfigHash;
+    QWORD ImageSize;
+    std::vector<ManifestFilesystem> Filesystems;
+} Manifest;
+
+bool loadManifest(std::string const& path, Manifest &manifest);
+bool saveManifest(std::string const& path, Manifest const& manifest);
+bool getSourceState(std::string const& path, QWORD &size, INT64 &modificationTime);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cal_types.h>
+
+typedef struct
+{
+    std::string Path;
+    QWORD Size;
+    std::string Error; // Empty when the lookup succeeded
+    bool RegularFile;
+} PreflightSource;
+
+typedef struct
+{
+    std::string Partition; // Empty when the problem isn't tied to a filesystem
+    std::string Path;
+    std::string Problem; // Short identifier, e.g. "missing_source" or "no_space"
+    std::string Detail;
+} PreflightProblem;
+
+void statSources(std::vector<PreflightSource> &sources);
+std::string formatPreflightProblems(std::vector<PreflightProblem> const& problems);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cal_types.h>
+
+typedef struct
+{
+    QWORD Size;
+    std::shared_ptr<std::vector<BYTE> const> Data; // Null when only the placement is known
+    std::string ImagePath;
+    QWORD ImageOffset; // Offset of the contiguous copy already written to ImagePath
+    bool Spilled; // ImagePath is a copy kept in the cache directory by an earlier build
+} SourceCacheEntry;
+
+class SourceCache
+{
+    private:
+        struct CachedSource
+        {
+            SourceCacheEntry entry;
+            std::list<std::string>::iterator memoryPosition;
+        };
+
+        QWORD memoryLimit;
+        QWORD memoryUsed;
+        std::string directory;
+        QWORD diskLimit;
+        QWORD diskUsed;
+        std::unordered_map<std::string, CachedSource> sources;
+        std::list<std::string> memoryLru; // Most recently used first
+        QWORD lookups;
+        QWORD memoryHits;
+        QWORD imageHits;
+        QWORD diskHits;
+        QWORD bytesServed;
+
+        void touchMemory(CachedSource &source, std::string const& key);
+        void keepInMemory(CachedSource &source, std::string const& key, BYTE const *data);
+        std::string getSpillPath(std::string const& key);
+        std::optional<SourceCacheEntry> findSpilled(std::string const& key, QWORD size);
+        void spill(std::string const& key, QWORD size, BYTE const *data);
+        void evict(QWORD targetSize);
+
+    public:
+        SourceCache(QWORD cacheMemoryLimit, std::string const& cacheDirectory = "", QWORD cacheDiskLimit = 0);
+
+        std::optional<SourceCacheEntry> find(std::string const& sourcePath, std::string &key);
+        void recordHit(std::string const& key, SourceCacheEntry const& entry, BYTE const *data);
+        void insert(std::string const& key, QWORD size, BYTE const *data, std::string const& imagePath, QWORD imageOffset);
+        void invalidateImage(std::string const& imagePath);
+        void printStatistics();
+};
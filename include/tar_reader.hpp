@@ -0,0 +1,48 @@
+#pragma once
+
+#include <istream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cal_types.h>
+
+typedef struct
+{
+    std::string Path; // Relative, '/' separated, without leading or trailing slashes
+    QWORD Size;
+    INT64 ModificationTime; // Seconds since the Unix epoch
+    bool Directory;
+    bool File; // Links and special files are neither
+    bool HardLink;
+    bool SymbolicLink;
+    std::string LinkTarget; // Normalized like Path for hard links, as stored for symbolic links
+} TarMember;
+
+// Reads ustar, pax and GNU archives member by member from a stream, which is only read forward
+// unless it is seekable. The data of a member may be read from getStream() between two calls to next
+class TarReader
+{
+    private:
+        std::istream &in;
+        bool seekable;
+        bool failed;
+        QWORD remaining; // Data of the current member which hasn't been read
+        QWORD padding; // Up to the next header
+
+        bool skip(QWORD bytes);
+        bool readBlock(char *block);
+        bool readText(QWORD size, std::string &text);
+
+    public:
+        TarReader(std::istream &stream, bool seekableStream);
+
+        bool next(TarMember &member);
+        bool hasFailed() const;
+        std::istream &getStream();
+        void setDataRead(QWORD bytes);
+};
+
+void setBinaryStandardInput();
+bool scanArchive(std::string const& path, std::vector<TarMember> &members, std::string &error);
+TarMember const *resolveLink(std::unordered_map<std::string, TarMember> const& members, TarMember const& link);
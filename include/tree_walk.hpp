@@ -0,0 +1,15 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+typedef struct
+{
+    std::string Path; // Relative to the walked directory, '/' separated
+    bool Directory;
+} TreeEntry;
+
+bool matchGlob(std::string_view pattern, std::string_view path);
+bool walkTree(std::string const& root, std::span<std::string const> include, std::span<std::string const> exclude, std::vector<TreeEntry> &entries, std::string &error);
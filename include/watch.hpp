@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <fat.hpp>
+
+template <DWORD SectorSize>
+struct WatchedFile
+{
+    BasicFat<SectorSize> *Filesystem;
+    std::string Source;
+    std::string Destination;
+};
+
+template <DWORD SectorSize>
+bool watchSources(std::vector<WatchedFile<SectorSize>> const& files);
@@ -0,0 +1,216 @@
+#include <build_cache.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <file_copy.hpp>
+#include <hash.hpp>
+#include <json.hpp>
+#include <manifest.hpp>
+
+using json = nlohmann::json;
+
+// Bump whenever the generated image changes for the same inputs
+#define BUILD_CACHE_VERSION 2
+
+#define BUILD_CACHE_ENTRY_EXTENSION ".img"
+#define BUILD_CACHE_STATISTICS "statistics.json"
+
+BuildCache::BuildCache(std::string const& cacheDirectory, QWORD cacheSizeLimit) : directory(cacheDirectory), sizeLimit(cacheSizeLimit), hits(0), misses(0), bytesSaved(0)
+{
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    loadStatistics();
+}
+
+std::string BuildCache::getEntryPath(QWORD key)
+{
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+    return (std::filesystem::path(directory) / (std::string(name) + BUILD_CACHE_ENTRY_EXTENSION)).string();
+}
+
+void BuildCache::loadStatistics()
+{
+    std::ifstream in(std::filesystem::path(directory) / BUILD_CACHE_STATISTICS);
+    if (!in.is_open())
+        return;
+
+    json jsonStatistics = json::parse(in, nullptr, false);
+    if (!jsonStatistics.is_object())
+        return;
+
+    hits = jsonStatistics.value("hits", 0ULL);
+    misses = jsonStatistics.value("misses", 0ULL);
+    bytesSaved = jsonStatistics.value("bytes_saved", 0ULL);
+}
+
+void BuildCache::saveStatistics()
+{
+    json jsonStatistics;
+    jsonStatistics["hits"] = hits;
+    jsonStatistics["misses"] = misses;
+    jsonStatistics["bytes_saved"] = bytesSaved;
+
+    std::ofstream out(std::filesystem::path(directory) / BUILD_CACHE_STATISTICS);
+    out << jsonStatistics.dump(1, '\t');
+}
+
+bool BuildCache::computeKey(Configuration const& config, QWORD &key)
+{
+    // The configuration is hashed from its parsed form, so formatting and key order don't matter
+    QWORD configHash = hashConfiguration(config);
+    key = computeHash64(reinterpret_cast<BYTE const*>(&configHash), sizeof(QWORD), BUILD_CACHE_VERSION);
+
+    for (auto const& partition : config.Partitions)
+    {
+        if (partition.Content.empty())
+            continue;
+
+        QWORD contentHash;
+        if (!computeFileHash64(partition.Content, contentHash))
+            return false;
+        key = computeHash64(reinterpret_cast<BYTE const*>(&contentHash), sizeof(QWORD), key);
+    }
+
+    for (auto const& filesystem : config.Filesystems)
+    {
+        for (auto const& file : filesystem.Files)
+        {
+            // Preallocated files are covered by the configuration hash
+            if (file.Source.empty())
+                continue;
+
+            QWORD fileHash;
+            if (!computeFileHash64(file.Source, fileHash))
+                return false;
+            key = computeHash64(reinterpret_cast<BYTE const*>(&fileHash), sizeof(QWORD), key);
+
+            // Entries are stamped with their source modification time unless the epoch is fixed
+            if (!config.SourceDateEpoch.has_value())
+            {
+                QWORD fileSize;
+                INT64 modificationTime;
+                if (!getSourceState(file.Source, fileSize, modificationTime))
+                    return false;
+                key = computeHash64(reinterpret_cast<BYTE const*>(&modificationTime), sizeof(INT64), key);
+            }
+        }
+
+        // Archives carry the timestamps of their members, stdin can't be hashed ahead of the build
+        for (auto const& archive : filesystem.Archives)
+        {
+            QWORD archiveHash;
+            if (archive.Source == "-" || !computeFileHash64(archive.Source, archiveHash))
+                return false;
+            key = computeHash64(reinterpret_cast<BYTE const*>(&archiveHash), sizeof(QWORD), key);
+        }
+    }
+
+    return true;
+}
+
+bool BuildCache::fetch(QWORD key, std::string const& outputPath)
+{
+    std::string entryPath = getEntryPath(key);
+    std::error_code error;
+    if (!std::filesystem::exists(entryPath, error))
+    {
+        misses++;
+        saveStatistics();
+        return false;
+    }
+
+    // Never write through an old output, it may itself be a link into the cache
+    std::filesystem::remove(outputPath, error);
+    if (!cloneFile(entryPath, outputPath))
+    {
+        std::filesystem::create_hard_link(entryPath, outputPath, error);
+        if (error)
+        {
+            misses++;
+            saveStatistics();
+            return false;
+        }
+    }
+
+    // Entries are evicted by least recent use, the modification time tracks the last hit
+    std::filesystem::last_write_time(entryPath, std::filesystem::file_time_type::clock::now(), error);
+
+    QWORD entrySize = getAllocatedSize(entryPath);
+    hits++;
+    bytesSaved += entrySize;
+    saveStatistics();
+
+    std::cout << "cache hit " << entryPath << ", " << entrySize << " bytes not rebuilt" << std::endl;
+    return true;
+}
+
+bool BuildCache::store(QWORD key, std::string const& outputPath)
+{
+    std::string entryPath = getEntryPath(key);
+    std::string temporaryPath = entryPath + ".tmp";
+    if (!copyFile(outputPath, temporaryPath))
+        return false;
+
+    // Outputs served by hard link share the entry, anything writing through them must fail instead of corrupting it
+    std::error_code error;
+    std::filesystem::permissions(temporaryPath, std::filesystem::perms::owner_read | std::filesystem::perms::group_read |
+        std::filesystem::perms::others_read, std::filesystem::perm_options::replace, error);
+    std::filesystem::rename(temporaryPath, entryPath, error);
+    if (error)
+    {
+        std::filesystem::remove(temporaryPath, error);
+        return false;
+    }
+
+    std::cout << "cache store " << entryPath << std::endl;
+    evict();
+    return true;
+}
+
+void BuildCache::evict()
+{
+    struct Entry
+    {
+        std::filesystem::path path;
+        std::filesystem::file_time_type lastUse;
+        QWORD size;
+    };
+
+    std::vector<Entry> entries;
+    QWORD totalSize = 0;
+    std::error_code error;
+    for (auto const& dirEntry : std::filesystem::directory_iterator(directory, error))
+    {
+        if (dirEntry.path().extension() != BUILD_CACHE_ENTRY_EXTENSION)
+            continue;
+        QWORD size = getAllocatedSize(dirEntry.path().string());
+        entries.push_back({dirEntry.path(), dirEntry.last_write_time(error), size});
+        totalSize += size;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b) { return a.lastUse < b.lastUse; });
+    for (auto const& entry : entries)
+    {
+        if (totalSize <= sizeLimit)
+            break;
+        std::filesystem::remove(entry.path, error);
+        totalSize -= entry.size;
+        std::cout << "cache evict " << entry.path.string() << std::endl;
+    }
+}
+
+void BuildCache::printStatistics()
+{
+    QWORD total = hits + misses;
+    std::cout << "cache: " << hits << " hits, " << misses << " misses";
+    if (total)
+        std::cout << " (" << (hits * 100 / total) << "% hit rate)";
+    std::cout << ", " << bytesSaved << " bytes saved" << std::endl;
+}
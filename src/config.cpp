@@ -0,0 +1,522 @@
+#include <config.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+#include <hash.hpp>
+#include <utf8.h>
+
+using json = nlohmann::json;
+
+static QWORD hashValue(QWORD value, QWORD hash)
+{
+    return computeHash64(reinterpret_cast<BYTE const*>(&value), sizeof(QWORD), hash);
+}
+
+static QWORD hashString(std::string const& str, QWORD hash)
+{
+    hash = hashValue(str.size(), hash);
+    return computeHash64(reinterpret_cast<BYTE const*>(str.data()), str.size(), hash);
+}
+
+static bool parseFileEntry(json const& jsonFile, ConfigurationFilesystem &filesystem)
+{
+    if (jsonFile.contains("source_dir"))
+    {
+        ConfigurationSourceDirectory sourceDirectory;
+        sourceDirectory.Source = jsonFile["source_dir"].get<std::string>();
+        sourceDirectory.Destination = jsonFile["destination"].get<std::string>();
+        if (jsonFile.contains("include"))
+            sourceDirectory.Include = jsonFile["include"].get<std::vector<std::string>>();
+        if (jsonFile.contains("exclude"))
+            sourceDirectory.Exclude = jsonFile["exclude"].get<std::vector<std::string>>();
+        filesystem.SourceDirectories.push_back(std::move(sourceDirectory));
+        return true;
+    }
+
+    if (jsonFile.contains("source_tar"))
+    {
+        ConfigurationArchive archive;
+        archive.Source = jsonFile["source_tar"].get<std::string>();
+        archive.Destination = jsonFile["destination"].get<std::string>();
+        filesystem.Archives.push_back(std::move(archive));
+        return true;
+    }
+
+    // A file without a source is preallocated: it gets its size in clusters and no data.
+    // "fill" is "zero", the default, or a byte value the clusters are written with
+    ConfigurationFile file;
+    if (jsonFile.contains("source"))
+        file.Source = jsonFile["source"].get<std::string>();
+    else
+    {
+        file.Size = jsonFile["size"].get<QWORD>();
+        if (jsonFile.contains("fill") && jsonFile["fill"] != "zero")
+        {
+            DWORD fill = jsonFile["fill"].get<DWORD>();
+            if (fill > 0xFF)
+                return false;
+            file.Fill = static_cast<BYTE>(fill);
+        }
+    }
+    file.Destination = jsonFile["destination"].get<std::string>();
+    if (jsonFile.contains("priority"))
+        file.Priority = jsonFile["priority"].get<DWORD>();
+    filesystem.Files.push_back(std::move(file));
+    return true;
+}
+
+// Builds the document like json::parse, except for the "directories" and "files" lists of every filesystem:
+// their elements are turned into configuration entries as soon as they are complete and never kept in the
+// document, so huge lists don't cost a DOM node per value
+class ConfigurationSax : public nlohmann::json_sax<json>
+{
+    private:
+        json &root;
+        std::vector<json*> stack; // nullptr stands for a streamed list
+        json *objectElement;
+        std::string lastKey;
+        json *filesystemsArray;
+        json listElement; // File entry being streamed
+        ConfigurationFile listFile; // Its plain fields, which skip the DOM
+        bool listFileSource;
+        bool listFileDestination;
+        bool streamingFiles;
+        std::vector<ConfigurationFilesystem> &streamed;
+
+        template <typename Value>
+        bool handleValue(Value &&value)
+        {
+            if (stack.empty())
+            {
+                root = json(std::forward<Value>(value));
+                return true;
+            }
+            if (!stack.back())
+            {
+                // Directories are plain strings, file entries only ever start as objects
+                json element(std::forward<Value>(value));
+                if (streamingFiles || !element.is_string())
+                    return false;
+                streamed.back().Directories.push_back(element.get<std::string>());
+                return true;
+            }
+            if (stack.back()->is_array())
+            {
+                stack.back()->emplace_back(std::forward<Value>(value));
+                return true;
+            }
+            if (!objectElement)
+                return handleFileField(std::forward<Value>(value));
+            *objectElement = json(std::forward<Value>(value));
+            return true;
+        }
+
+        template <typename Value>
+        bool handleFileField(Value &&value)
+        {
+            if constexpr (std::is_same_v<std::decay_t<Value>, json::string_t>)
+            {
+                if (lastKey == "priority")
+                    return false;
+                (lastKey == "source" ? listFileSource : listFileDestination) = true;
+                (lastKey == "source" ? listFile.Source : listFile.Destination) = std::move(value);
+                return true;
+            }
+            else if constexpr (std::is_same_v<std::decay_t<Value>, json::number_unsigned_t>)
+            {
+                if (lastKey != "priority" || value > UINT32_MAX)
+                    return false;
+                listFile.Priority = static_cast<DWORD>(value);
+                return true;
+            }
+            else
+                return false;
+        }
+
+        json *startContainer(json value)
+        {
+            if (stack.empty())
+            {
+                root = std::move(value);
+                return &root;
+            }
+            if (!stack.back())
+            {
+                listElement = std::move(value);
+                return &listElement;
+            }
+            if (stack.back()->is_array())
+            {
+                stack.back()->push_back(std::move(value));
+                return &stack.back()->back();
+            }
+            *objectElement = std::move(value);
+            return objectElement;
+        }
+
+    public:
+        ConfigurationSax(json &document, std::vector<ConfigurationFilesystem> &streamedFilesystems) :
+            root(document),
+            objectElement(nullptr),
+            filesystemsArray(nullptr),
+            listFileSource(false),
+            listFileDestination(false),
+            streamingFiles(false),
+            streamed(streamedFilesystems)
+        {
+        }
+
+        bool null() override { return handleValue(nullptr); }
+        bool boolean(bool value) override { return handleValue(value); }
+        bool number_integer(json::number_integer_t value) override { return handleValue(value); }
+        bool number_unsigned(json::number_unsigned_t value) override { return handleValue(value); }
+        bool number_float(json::number_float_t value, json::string_t const&) override { return handleValue(value); }
+        bool string(json::string_t &value) override { return handleValue(std::move(value)); }
+        bool binary(json::binary_t &value) override { return handleValue(std::move(value)); }
+
+        bool start_object(std::size_t) override
+        {
+            // Objects are only allowed in a streamed list of files
+            if (!stack.empty() && !stack.back() && !streamingFiles)
+                return false;
+            stack.push_back(startContainer(json::object()));
+            return true;
+        }
+
+        bool key(json::string_t &value) override
+        {
+            // The common fields of a file entry go straight into listFile
+            lastKey = value;
+            if (stack.back() == &listElement && (value == "source" || value == "destination" || value == "priority"))
+                objectElement = nullptr;
+            else
+                objectElement = &(*stack.back())[value];
+            return true;
+        }
+
+        bool end_object() override
+        {
+            stack.pop_back();
+            if (stack.empty() || stack.back())
+                return true;
+
+            if (listElement.empty())
+            {
+                if (!listFileSource || !listFileDestination)
+                    return false;
+                streamed.back().Files.push_back(std::move(listFile));
+            }
+            else
+            {
+                // Trees and archives take the general path
+                if (listFileSource)
+                    listElement["source"] = std::move(listFile.Source);
+                if (listFileDestination)
+                    listElement["destination"] = std::move(listFile.Destination);
+                if (listFile.Priority.has_value())
+                    listElement["priority"] = listFile.Priority.value();
+                if (!parseFileEntry(listElement, streamed.back()))
+                    return false;
+            }
+            listElement = json();
+            listFile = ConfigurationFile();
+            listFileSource = false;
+            listFileDestination = false;
+            return true;
+        }
+
+        bool start_array(std::size_t) override
+        {
+            // The lists of a filesystem object, directly inside the "filesystems" array of the root object
+            bool list = stack.size() == 3 && stack[1] == filesystemsArray && stack[2]->is_object() &&
+                (lastKey == "files" || lastKey == "directories");
+            if (list)
+            {
+                streamingFiles = lastKey == "files";
+                stack[2]->erase(lastKey);
+                streamed.resize(filesystemsArray->size());
+                stack.push_back(nullptr);
+                return true;
+            }
+
+            if (!stack.empty() && !stack.back())
+                return false;
+            json *array = startContainer(json::array());
+            if (stack.size() == 1 && stack[0]->is_object() && lastKey == "filesystems")
+                filesystemsArray = array;
+            stack.push_back(array);
+            return true;
+        }
+
+        bool end_array() override
+        {
+            stack.pop_back();
+            return true;
+        }
+
+        bool parse_error(std::size_t, std::string const&, nlohmann::detail::exception const&) override
+        {
+            return false;
+        }
+};
+
+int loadConfiguration(std::string const& path, Configuration &config)
+{
+    // Machine generated configurations may come as CBOR or MessagePack, picked by the extension
+    json::input_format_t format = json::input_format_t::json;
+    std::string extension = std::filesystem::path(path).extension().string();
+    if (extension == ".cbor")
+        format = json::input_format_t::cbor;
+    else if (extension == ".msgpack")
+        format = json::input_format_t::msgpack;
+
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in.is_open())
+        return 1;
+
+    json jsonConfig;
+    std::vector<ConfigurationFilesystem> streamed;
+    ConfigurationSax sax(jsonConfig, streamed);
+    if (!json::sax_parse(in, &sax, format))
+        return 11;
+
+    int ret = parseConfiguration(jsonConfig, config);
+    if (ret)
+        return ret;
+
+    // Streamed lists come after entries given any other way, in the order they were read
+    for (size_t i = 0; i < streamed.size() && i < config.Filesystems.size(); i++)
+    {
+        auto &filesystem = config.Filesystems[i];
+        std::move(streamed[i].Directories.begin(), streamed[i].Directories.end(), std::back_inserter(filesystem.Directories));
+        std::move(streamed[i].Files.begin(), streamed[i].Files.end(), std::back_inserter(filesystem.Files));
+        std::move(streamed[i].SourceDirectories.begin(), streamed[i].SourceDirectories.end(), std::back_inserter(filesystem.SourceDirectories));
+        std::move(streamed[i].Archives.begin(), streamed[i].Archives.end(), std::back_inserter(filesystem.Archives));
+    }
+
+    return 0;
+}
+
+int parseConfiguration(json const& jsonConfig, Configuration &config)
+{
+    // The output is either a path or a list of paths, the image is built into the first one
+    if (jsonConfig["output"].is_array())
+    {
+        for (auto const &jsonOutput : jsonConfig["output"])
+            config.ExtraOutputs.push_back(jsonOutput.get<std::string>());
+        if (config.ExtraOutputs.empty())
+            return 1;
+        config.Output = config.ExtraOutputs.front();
+        config.ExtraOutputs.erase(config.ExtraOutputs.begin());
+    }
+    else
+        config.Output = jsonConfig["output"].get<std::string>();
+    config.Reproducible = false;
+
+    // Images are built for 512 byte sectors unless the target is 4K native
+    config.SectorSize = SECTOR_SIZE_512;
+    if (jsonConfig.contains("sector_size"))
+        config.SectorSize = jsonConfig["sector_size"].get<DWORD>();
+    if (config.SectorSize != SECTOR_SIZE_512 && config.SectorSize != SECTOR_SIZE_4K)
+        return 11;
+
+    // Both are powers of two no smaller than a sector, erase blocks have to fit in the FAT reserved area
+    config.Alignment = DEFAULT_PARTITION_ALIGNMENT;
+    if (jsonConfig.contains("alignment"))
+        config.Alignment = jsonConfig["alignment"].get<QWORD>();
+    config.EraseBlockSize = 0;
+    if (jsonConfig.contains("erase_block_size"))
+        config.EraseBlockSize = jsonConfig["erase_block_size"].get<DWORD>();
+    if (config.Alignment < config.SectorSize || (config.Alignment & (config.Alignment - 1)) ||
+        (config.EraseBlockSize && (config.EraseBlockSize < config.SectorSize || config.EraseBlockSize > 16 * 1024 * 1024 ||
+        (config.EraseBlockSize & (config.EraseBlockSize - 1)))))
+        return 11;
+
+    // Create the partition config
+    config.Partitions.reserve(8);
+    for (auto const &jsonPartition : jsonConfig["partitions"])
+    {
+        ConfigurationParitition partition;
+
+        if (jsonPartition["type"] == "EFI")
+            partition.Type = EFI_PART_TYPE_EFI_SYSTEM_PART_GUID;
+        else if (jsonPartition["type"] == "BDP")
+            partition.Type = EFI_PART_TYPE_MICROSOFT_BASIC_DATA_GUID;
+        else if (jsonPartition["type"] == "LINUX_SWAP")
+            partition.Type = EFI_PART_TYPE_LINUX_SWAP_GUID;
+        else
+            return 2;
+        
+        // A prebuilt image (rootfs, swap header, firmware) can be placed in a partition without a filesystem
+        if (jsonPartition.contains("content"))
+            partition.Content = jsonPartition["content"].get<std::string>();
+
+        // "auto" sizes are planned at build time, from the content and headroom percent more
+        if (jsonPartition["size"] == "auto")
+        {
+            partition.Size = 0;
+            partition.Headroom = jsonPartition.contains("headroom") ? jsonPartition["headroom"].get<DWORD>() : 0;
+            if (partition.Headroom.value() > 1000)
+                return 11;
+        }
+        else
+        {
+            partition.Size = jsonPartition["size"].get<QWORD>() * 1024;
+            if (partition.Size % config.SectorSize || jsonPartition.contains("headroom"))
+                return 11;
+        }
+        partition.PartitionName = utf8::utf8to16(jsonPartition["name"].get<std::string>());
+        config.Partitions.push_back(partition);
+    }
+
+    if (jsonConfig.contains("variants"))
+    {
+        for (auto const &jsonVariant : jsonConfig["variants"])
+        {
+            ConfigurationVariant variant;
+            variant.Output = jsonVariant["output"].get<std::string>();
+            for (auto const &jsonFile : jsonVariant["files"])
+            {
+                ConfigurationVariantFile file;
+                file.Partition = jsonFile["partition"].get<std::string>();
+                file.Source = jsonFile["source"].get<std::string>();
+                file.Destination = jsonFile["destination"].get<std::string>();
+                variant.Files.push_back(file);
+            }
+            config.Variants.push_back(std::move(variant));
+        }
+    }
+
+    static json const noFilesystems = json::array();
+    json const &jsonFilesystems = jsonConfig.contains("filesystems") ? jsonConfig["filesystems"] : noFilesystems;
+    for (auto const &jsonFilesystem : jsonFilesystems)
+    {
+        ConfigurationFilesystem filesystem;
+        filesystem.Partition = jsonFilesystem["partition"].get<std::string>();
+
+        // Either a power of two from one sector to 64 KiB or "auto"
+        filesystem.ClusterSize = 0;
+        filesystem.OptimizeClusterSize = false;
+        if (jsonFilesystem.contains("cluster_size"))
+        {
+            if (jsonFilesystem["cluster_size"] == "auto")
+                filesystem.OptimizeClusterSize = true;
+            else
+            {
+                filesystem.ClusterSize = jsonFilesystem["cluster_size"].get<DWORD>();
+                if (filesystem.ClusterSize < config.SectorSize || filesystem.ClusterSize > 64 * 1024 ||
+                    (filesystem.ClusterSize & (filesystem.ClusterSize - 1)))
+                    return 11;
+            }
+        }
+
+        if (jsonFilesystem.contains("directories"))
+        {
+            for (auto const &jsonDirectory : jsonFilesystem["directories"])
+                filesystem.Directories.push_back(jsonDirectory.get<std::string>());
+        }
+
+        if (jsonFilesystem.contains("files"))
+        {
+            for (auto const &jsonFile : jsonFilesystem["files"])
+            {
+                if (!parseFileEntry(jsonFile, filesystem))
+                    return 11;
+            }
+        }
+
+        config.Filesystems.push_back(std::move(filesystem));
+    }
+
+    // Only a filesystem or a content image gives an auto sized partition something to be sized for,
+    // a partition can't have both
+    for (auto const &partition : config.Partitions)
+    {
+        std::string name = utf8::utf16to8(partition.PartitionName);
+        bool hasFilesystem = std::any_of(config.Filesystems.begin(), config.Filesystems.end(),
+            [&name](ConfigurationFilesystem const &filesystem) { return filesystem.Partition == name; });
+        if (hasFilesystem ? !partition.Content.empty() : partition.Headroom.has_value() && partition.Content.empty())
+            return 11;
+    }
+
+    return 0;
+}
+
+QWORD hashConfiguration(Configuration const& config)
+{
+    // Every string and list is hashed together with its length, so field boundaries can't shift
+    // Variants and extra outputs are left out, they don't change the base image
+    QWORD hash = hashString(config.Output, 0);
+
+    hash = hashValue(config.Partitions.size(), hash);
+    for (auto const& partition : config.Partitions)
+    {
+        hash = computeHash64(reinterpret_cast<BYTE const*>(&partition.Type), sizeof(EFI_GUID), hash);
+        hash = hashValue(partition.Size, hash);
+        hash = hashString(utf8::utf16to8(partition.PartitionName), hash);
+        hash = hashValue(partition.Headroom.has_value(), hash);
+        hash = hashValue(partition.Headroom.value_or(0), hash);
+        hash = hashString(partition.Content, hash);
+    }
+
+    hash = hashValue(config.SectorSize, hash);
+    hash = hashValue(config.Alignment, hash);
+    hash = hashValue(config.EraseBlockSize, hash);
+
+    hash = hashValue(config.Filesystems.size(), hash);
+    for (auto const& filesystem : config.Filesystems)
+    {
+        hash = hashString(filesystem.Partition, hash);
+        hash = hashValue(filesystem.ClusterSize, hash);
+        hash = hashValue(filesystem.OptimizeClusterSize, hash);
+        hash = hashValue(filesystem.Directories.size(), hash);
+        for (auto const& directory : filesystem.Directories)
+            hash = hashString(directory, hash);
+        hash = hashValue(filesystem.Files.size(), hash);
+        for (auto const& file : filesystem.Files)
+        {
+            hash = hashString(file.Source, hash);
+            hash = hashString(file.Destination, hash);
+            hash = hashValue(file.Priority.has_value(), hash);
+            hash = hashValue(file.Priority.value_or(0), hash);
+
+            // The size of a source is part of its content, a preallocated file has only this one
+            if (file.Source.empty())
+            {
+                hash = hashValue(file.Size.value_or(0), hash);
+                hash = hashValue(file.Fill.has_value(), hash);
+                hash = hashValue(file.Fill.value_or(0), hash);
+            }
+        }
+        hash = hashValue(filesystem.SourceDirectories.size(), hash);
+        for (auto const& sourceDirectory : filesystem.SourceDirectories)
+        {
+            hash = hashString(sourceDirectory.Source, hash);
+            hash = hashString(sourceDirectory.Destination, hash);
+            hash = hashValue(sourceDirectory.Include.size(), hash);
+            for (auto const& pattern : sourceDirectory.Include)
+                hash = hashString(pattern, hash);
+            hash = hashValue(sourceDirectory.Exclude.size(), hash);
+            for (auto const& pattern : sourceDirectory.Exclude)
+                hash = hashString(pattern, hash);
+        }
+        hash = hashValue(filesystem.Archives.size(), hash);
+        for (auto const& archive : filesystem.Archives)
+        {
+            hash = hashString(archive.Source, hash);
+            hash = hashString(archive.Destination, hash);
+        }
+    }
+
+    hash = hashValue(config.Reproducible, hash);
+    if (config.Reproducible)
+    {
+        hash = hashString(config.Seed, hash);
+        hash = hashValue(config.SourceDateEpoch.has_value(), hash);
+        hash = hashValue(config.SourceDateEpoch.value_or(0), hash);
+    }
+
+    return hash;
+}
@@ -3,9 +3,15 @@
 #include <iostream>
 #include <fstream>
 #include <cassert>
-#include <sstream>
 #include <cstring>
 #include <ctime>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+
+#include <hash.hpp>
+#include <utf8.h>
 
 struct DSKSZTOSECPERCLUS
 {
@@ -35,17 +41,95 @@ DSKSZTOSECPERCLUS DskTableFAT32[] = {
     {0xFFFFFFFF, 64} /* disks greater than 32GB, 32k cluster */
 };
 
-Fat::Fat(std::string const &outputPath, GptPartition const &partition) : destination(outputPath), os(outputPath, std::ios::out | std::ios::in | std::ios::binary), partition(partition) {}
+// 1980-01-01 00:00:00 UTC, the first representable FAT timestamp
+#define FAT_EPOCH 315532800
+
+// The cluster size table assumes this layout
+#define FAT_RESERVED_SECTORS 32
+#define FAT_NUMBER_OF_FATS 2
+
+// Path components are interned into blocks of this size
+#define FAT_NAME_BLOCK_SIZE (64 * 1024)
+
+template <DWORD SectorSize>
+BasicFat<SectorSize>::BasicFat(std::string const &outputPath, GptPartition const &partition) : destination(outputPath), numberOfFats(FAT_NUMBER_OF_FATS), os(outputPath, std::ios::out | std::ios::in | std::ios::binary), partition(partition), reproducible(false), sourceCache(nullptr), nameBlockUsed(0), nameBytes(0), lastParent(0), pathStatistics{}, reservedClusterCount(0), clusterEnd(0), eraseBlockSize(0), requestedClusterSize(0) {}
+
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::setSourceCache(SourceCache *cache)
+{
+    sourceCache = cache;
+}
+
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::setEraseBlockSize(DWORD size)
+{
+    eraseBlockSize = size;
+}
+
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::setClusterSize(DWORD size)
+{
+    requestedClusterSize = size;
+}
+
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::setReproducible(std::optional<std::time_t> timestamp)
+{
+    // Without a fixed timestamp files are stamped with their source modification time
+    // and directories with the FAT epoch
+    reproducible = true;
+    fixedTimestamp = timestamp;
+}
 
-DWORD Fat::computeFatSizeInSectors()
+template <DWORD SectorSize>
+DWORD BasicFat<SectorSize>::computeFatSizeInSectors(QWORD lbaCount, DWORD reservedSectors, DWORD clusterSectors)
 {
-    DWORD tmpVal1 = static_cast<DWORD>(partition.LBACount) - reservedSectorCount;
-    DWORD tmpVal2 = ((256 * sectorsPerCluster) + numberOfFats) / 2;
+    DWORD tmpVal1 = static_cast<DWORD>(lbaCount) - reservedSectors;
+    DWORD tmpVal2 = (((SectorSize / 2) * clusterSectors) + FAT_NUMBER_OF_FATS) / 2;
     float sz = (tmpVal1 + (tmpVal2 - 1)) / ((float) tmpVal2);
     return std::ceil(sz);
 }
 
-std::unique_ptr<FAT_BPB> Fat::getFatBiosParameterBlock()
+template <DWORD SectorSize>
+DWORD BasicFat<SectorSize>::getDefaultSectorsPerCluster()
+{
+    // The table is in 512 byte sectors, larger sectors keep the cluster size in bytes where they can
+    QWORD diskSize = partition.LBACount * (SectorSize / 512);
+    for (int i = 0; i < 6; i++)
+    {
+        if (diskSize <= DskTableFAT32[i].DiskSize)
+            return DskTableFAT32[i].SecPerClusVal ? std::max<DWORD>(DskTableFAT32[i].SecPerClusVal * 512 / SectorSize, 1) : 0;
+    }
+    return 0;
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::computeGeometry(DWORD clusterSectors, DWORD &reservedSectors, DWORD &fatSectors, DWORD &clusterCount)
+{
+    // Grow the reserved area until the data region starts on an erase block boundary of the disk,
+    // a larger reserved area can only shrink the FATs so this settles after a few rounds
+    fatSectors = computeFatSizeInSectors(partition.LBACount, reservedSectors, clusterSectors);
+    DWORD eraseBlockSectors = eraseBlockSize / SectorSize;
+    while (eraseBlockSectors > 1)
+    {
+        QWORD firstDataLba = partition.StartingLBA + reservedSectors + numberOfFats * fatSectors;
+        DWORD padding = (eraseBlockSectors - firstDataLba % eraseBlockSectors) % eraseBlockSectors;
+        if (!padding)
+            break;
+        if (reservedSectors + padding > UINT16_MAX)
+            return false;
+        reservedSectors += padding;
+        fatSectors = computeFatSizeInSectors(partition.LBACount, reservedSectors, clusterSectors);
+    }
+
+    if (partition.LBACount <= reservedSectors + numberOfFats * fatSectors)
+        return false;
+    clusterCount = (partition.LBACount - (reservedSectors + numberOfFats * fatSectors)) / clusterSectors;
+    return true;
+}
+
+template <DWORD SectorSize>
+std::unique_ptr<FAT_BPB> BasicFat<SectorSize>::getFatBiosParameterBlock()
 {
     auto ret = std::make_unique<FAT_BPB>();
     
@@ -53,19 +137,16 @@ std::unique_ptr<FAT_BPB> Fat::getFatBiosParameterBlock()
     ret->BS_jmpBoot[1] = 0xFE;
     ret->BS_jmpBoot[2] = 0x90;
     std::memcpy(ret->BS_OEMName, "SIPOSDV", 8);
-    ret->BPB_BytsPerSec = SECTOR_SIZE;
+    ret->BPB_BytsPerSec = SectorSize;
 
-    sectorsPerCluster = 0;
-    for (int i = 0; i < 6; i++)
-    {
-        if (static_cast<DWORD>(partition.LBACount) <= DskTableFAT32[i].DiskSize) {
-            sectorsPerCluster = DskTableFAT32[i].SecPerClusVal;
-            break;
-        }
-    }
-    if (!sectorsPerCluster)
+    // A requested cluster size has to give a valid FAT32 cluster count, the table is trusted as it is
+    sectorsPerCluster = requestedClusterSize ? requestedClusterSize / SectorSize : getDefaultSectorsPerCluster();
+    DWORD clusterCount;
+    if (!sectorsPerCluster || !computeGeometry(sectorsPerCluster, reservedSectorCount, fatSize, clusterCount))
         return nullptr;
-    
+    if (requestedClusterSize && (clusterCount < FAT16_MAX_CLUSTERS || clusterCount > FAT32_MAX_CLUSTERS))
+        return nullptr;
+
     ret->BPB_SecPerClus = sectorsPerCluster;
     ret->BPB_RsvdSecCnt = reservedSectorCount;
     ret->BPB_NumFATs = numberOfFats;
@@ -78,7 +159,6 @@ std::unique_ptr<FAT_BPB> Fat::getFatBiosParameterBlock()
     ret->BPB_HiddSec = 0;
     ret->BPB_TotSec32 = static_cast<DWORD>(partition.LBACount);
 
-    fatSize = computeFatSizeInSectors();
     ret->DiffOffset.FAT32_BPB.BPB_FATSz32 = fatSize;
     ret->DiffOffset.FAT32_BPB.BPB_ExtFlags = 0;
     ret->DiffOffset.FAT32_BPB.BPB_FSVer = 0;
@@ -87,7 +167,7 @@ std::unique_ptr<FAT_BPB> Fat::getFatBiosParameterBlock()
     ret->DiffOffset.FAT32_BPB.BPB_BkBootSec = 6;
     ret->DiffOffset.FAT32_BPB.BS_DrvNum = 0x80;
     ret->DiffOffset.FAT32_BPB.BS_BootSig = 0x29;
-    ret->DiffOffset.FAT32_BPB.BS_VolID = 0xFEEDFACE;
+    ret->DiffOffset.FAT32_BPB.BS_VolID = partition.PartitionId.Data1; // Random, or derived from the seed when reproducible
     std::memcpy(ret->DiffOffset.FAT32_BPB.BS_VolLab, "NO NAME   ", 11);
     std::memcpy(ret->DiffOffset.FAT32_BPB.BS_FilSysType, "FAT32  ", 8);
     ret->Signature = 0xAA55;
@@ -95,7 +175,8 @@ std::unique_ptr<FAT_BPB> Fat::getFatBiosParameterBlock()
     return ret;
 }
 
-std::unique_ptr<FSINFO> Fat::getFatFsInfo()
+template <DWORD SectorSize>
+std::unique_ptr<FSINFO> BasicFat<SectorSize>::getFatFsInfo()
 {
     auto ret = std::make_unique<FSINFO>();
 
@@ -108,25 +189,29 @@ std::unique_ptr<FSINFO> Fat::getFatFsInfo()
     return ret;
 }
 
-DWORD Fat::getFirstSectorOfCluster(DWORD cluster)
+template <DWORD SectorSize>
+DWORD BasicFat<SectorSize>::getFirstSectorOfCluster(DWORD cluster)
 {
     DWORD firstDataSector = reservedSectorCount + (numberOfFats * fatSize);
     return ((cluster - 2) * sectorsPerCluster) + firstDataSector;
 }
 
-void Fat::writeToFatEntry(DWORD fatTable, DWORD fatEntry, DWORD value)
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::writeToFatEntry(DWORD fatTable, DWORD fatEntry, DWORD value)
 {
-    os.seekp(partition.StartingLBA * SECTOR_SIZE + reservedSectorCount * SECTOR_SIZE + (fatTable * fatSize) * SECTOR_SIZE + 4 * fatEntry);
+    os.seekp(partition.StartingLBA * SectorSize + reservedSectorCount * SectorSize + (fatTable * fatSize) * SectorSize + 4 * fatEntry);
     os.write(reinterpret_cast<const char *>(&value), sizeof(DWORD));
 }
 
-void Fat::writeToSector(DWORD sector, BYTE* buffer, DWORD size)
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::writeToSector(DWORD sector, BYTE* buffer, DWORD size)
 {
-    os.seekp(partition.StartingLBA * SECTOR_SIZE + sector * SECTOR_SIZE);
+    os.seekp(partition.StartingLBA * SectorSize + static_cast<QWORD>(sector) * SectorSize);
     os.write(reinterpret_cast<const char *>(buffer), size);
 }
 
-void Fat::createRootDirectory()
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::createRootDirectory()
 {
     // Allocate cluster 2 to root directory
     writeToFatEntry(0, 0, 0x0FFFFFF8);
@@ -137,28 +222,30 @@ void Fat::createRootDirectory()
     writeToFatEntry(1, 2, FAT32_EOC_MARK);
 }
 
-void Fat::createFilesystem()
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::createFilesystem()
 {
-    reservedSectorCount = 32;
-    numberOfFats = 2;
+    reservedSectorCount = FAT_RESERVED_SECTORS;
+    numberOfFats = FAT_NUMBER_OF_FATS;
+    firstFsInfoSec = 1;
+    secondFsInfoSec = 7;
 
     auto bpb = getFatBiosParameterBlock();
+    if (!bpb)
+        return false;
     auto fs = getFatFsInfo();
 
-    os.seekp(partition.StartingLBA * SECTOR_SIZE);
-
-    // Write primary headers
-    os.write(reinterpret_cast<const char *>(bpb.get()), sizeof(FAT_BPB)); // Sector 0
-    os.write(reinterpret_cast<const char *>(fs.get()), sizeof(FSINFO)); // Sector 1
+    // Write primary headers, every structure starts its own sector whatever the sector size
+    writeToSector(0, reinterpret_cast<BYTE*>(bpb.get()), sizeof(FAT_BPB));
+    writeToSector(firstFsInfoSec, reinterpret_cast<BYTE*>(fs.get()), sizeof(FSINFO));
 
     // Write secondary headers
-    os.seekp(partition.StartingLBA * SECTOR_SIZE + 7 * SECTOR_SIZE);
     bpb.get()->DiffOffset.FAT32_BPB.BPB_FSInfo = 7;
-    os.write(reinterpret_cast<const char *>(bpb.get()), sizeof(FAT_BPB)); // Sector 6
-    os.write(reinterpret_cast<const char *>(fs.get()), sizeof(FSINFO)); // Sector 7
+    writeToSector(6, reinterpret_cast<BYTE*>(bpb.get()), sizeof(FAT_BPB));
+    writeToSector(secondFsInfoSec, reinterpret_cast<BYTE*>(fs.get()), sizeof(FSINFO));
 
     // Zero out the whole file
-    os.seekp(partition.StartingLBA * SECTOR_SIZE + partition.LBACount * SECTOR_SIZE - 1);
+    os.seekp(partition.StartingLBA * SectorSize + partition.LBACount * SectorSize - 1);
     char zero = 0;
     os.write(&zero, 1);
 
@@ -166,12 +253,15 @@ void Fat::createFilesystem()
     createRootDirectory();
 
     os.close();
+    return true;
 }
 
-std::pair<FATDATE, FATTIME> Fat::getCurrentDateAndTime()
+template <DWORD SectorSize>
+std::pair<FATDATE, FATTIME> BasicFat<SectorSize>::getDateAndTime(std::time_t timestamp)
 {
-    std::time_t t = std::time(NULL);
-    std::tm *localTime = std::localtime(&t);
+    // Reproducible images must not depend on the timezone of the build machine
+    timestamp = std::max<std::time_t>(timestamp, FAT_EPOCH);
+    std::tm *localTime = reproducible ? std::gmtime(&timestamp) : std::localtime(&timestamp);
 
     // Set date
     FATDATE date;
@@ -190,61 +280,180 @@ std::pair<FATDATE, FATTIME> Fat::getCurrentDateAndTime()
     return std::make_pair(date, time);
 }
 
-static bool getShortName(std::string const& name, std::string &shortName)
+template <DWORD SectorSize>
+std::pair<FATDATE, FATTIME> BasicFat<SectorSize>::getCurrentDateAndTime()
 {
-    size_t length = name.length();
-    size_t dotindx = name.find('.');
-    
-    size_t dotlength;
-    size_t namelen;
-    bool isLongName = false;
-    if (dotindx != std::string::npos)
+    if (reproducible)
+        return getDateAndTime(fixedTimestamp.value_or(FAT_EPOCH));
+    return getDateAndTime(std::time(NULL));
+}
+
+template <DWORD SectorSize>
+std::pair<FATDATE, FATTIME> BasicFat<SectorSize>::getFileDateAndTime(std::string const& sourcePath)
+{
+    if (!reproducible || fixedTimestamp.has_value())
+        return getCurrentDateAndTime();
+
+    std::error_code error;
+    auto writeTime = std::filesystem::last_write_time(sourcePath, error);
+    if (error)
+        return getCurrentDateAndTime();
+
+    auto systemTime = std::chrono::file_clock::to_sys(writeTime);
+    return getDateAndTime(std::chrono::system_clock::to_time_t(std::chrono::time_point_cast<std::chrono::system_clock::duration>(systemTime)));
+}
+
+size_t FatNameHash::operator()(std::string_view name) const
+{
+    // FNV-1a over the upper case characters
+    QWORD hash = 14695981039346656037ULL;
+    for (char c : name)
     {
-        if (dotindx > 8 || length - dotindx - 1 > 3)
-            isLongName = true;
-        dotlength = std::min(length - dotindx - 1, static_cast<size_t>(3));
-        namelen = std::min(dotindx, static_cast<size_t>(8));
+        hash ^= static_cast<BYTE>(std::toupper(static_cast<unsigned char>(c)));
+        hash *= 1099511628211ULL;
     }
+    return static_cast<size_t>(hash);
+}
+
+bool FatNameEqual::operator()(std::string_view a, std::string_view b) const
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(),
+        [](char x, char y) { return std::toupper(static_cast<unsigned char>(x)) == std::toupper(static_cast<unsigned char>(y)); });
+}
+
+// Entries per directory, directories differing in case are the same one
+typedef std::unordered_map<std::string_view, DWORD, FatNameHash, FatNameEqual> FatEntryCounts;
+
+static bool getShortNameCharacter(char c, char &shortCharacter)
+{
+    // Spaces and dots are dropped from the basis, everything outside the 8.3 character set becomes '_'
+    if (c == ' ' || c == '.')
+        return false;
+
+    if (c >= 'a' && c <= 'z')
+        shortCharacter = c - 'a' + 'A';
+    else if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || std::strchr("$%'-_@~`!(){}^#&", c))
+        shortCharacter = c;
     else
+        shortCharacter = '_';
+    return true;
+}
+
+static bool getShortNamePart(std::string_view part, char *shortPart, DWORD maxLength, bool &lower)
+{
+    // Returns true when the part does not survive the conversion. A part written
+    // entirely in lower case is stored upper case and flagged in DIR_NTRes instead
+    bool lossy = false;
+    bool hasLower = false;
+    bool hasUpper = false;
+    DWORD length = 0;
+    for (char c : part)
     {
-        if (length > 8)
-            isLongName = true;
-        dotlength = 0;
-        namelen = std::min(length, static_cast<size_t>(8));
-    }
-    
-    std::string temp = "           ";
-    if(dotlength)
-    {
-        int i = dotindx + 1;
-        int j = 8;
-        while(dotlength)
+        char shortCharacter;
+        if (!getShortNameCharacter(c, shortCharacter))
         {
-            temp[j] = towupper(name[i]);
-            i++;
-            j++;
-            dotlength--;
+            lossy = true;
+            continue;
         }
+        if (shortCharacter == '_' && c != '_')
+            lossy = true;
+        if (length == maxLength)
+        {
+            lossy = true;
+            break;
+        }
+        hasLower |= c >= 'a' && c <= 'z';
+        hasUpper |= c >= 'A' && c <= 'Z';
+        shortPart[length++] = shortCharacter;
     }
-    
-    if (namelen)
+
+    lower = hasLower;
+    return lossy || (hasLower && hasUpper);
+}
+
+static bool getShortNameBasis(std::string_view name, std::string &shortName, BYTE &caseFlags)
+{
+    // Returns true when the name does not survive the conversion and needs long entries
+    shortName.assign(11, ' ');
+    caseFlags = 0;
+    size_t first = name.find_first_not_of(". ");
+    if (first == std::string_view::npos)
+    {
+        shortName[0] = '_';
+        return true;
+    }
+
+    bool lossy = first != 0;
+    size_t lastDot = name.find_last_of('.');
+    if (lastDot != std::string_view::npos && lastDot < first)
+        lastDot = std::string_view::npos;
+    if (lastDot == name.length() - 1)
+        lossy = true;
+
+    bool lowerBase;
+    bool lowerExtension = false;
+    lossy |= getShortNamePart(name.substr(first, lastDot == std::string_view::npos ? std::string_view::npos : lastDot - first), shortName.data(), SHORT_NAME_NAME, lowerBase);
+    if (lastDot != std::string_view::npos)
+        lossy |= getShortNamePart(name.substr(lastDot + 1), shortName.data() + SHORT_NAME_NAME, SHORT_NAME_EXT, lowerExtension);
+
+    if (shortName[0] == ' ')
+    {
+        shortName[0] = '_';
+        lossy = true;
+    }
+
+    if (lossy)
+        return true;
+    caseFlags = (lowerBase ? NTRES_LOWER_CASE_BASE : 0) | (lowerExtension ? NTRES_LOWER_CASE_EXT : 0);
+    return false;
+}
+
+static bool getNumericTail(std::string const& shortName, std::string_view prefix, DWORD tail, std::string &alias)
+{
+    std::string tailString = "~" + std::to_string(tail);
+    if (tailString.length() > 7)
+        return false;
+
+    alias.assign(11, ' ');
+    prefix = prefix.substr(0, std::min<size_t>(prefix.find(' '), 8 - tailString.length()));
+    std::memcpy(alias.data(), prefix.data(), prefix.length());
+    std::memcpy(alias.data() + prefix.length(), tailString.data(), tailString.length());
+    std::memcpy(alias.data() + 8, shortName.data() + 8, 3);
+    return true;
+}
+
+// 255 UTF-16 units rounded up to whole slices
+#define LONG_NAME_MAX_SLICES 20
+
+static bool getLongName(std::string_view name, char16_t *longName, DWORD &length)
+{
+    // longName has room for the 255 UTF-16 units a long name may hold. Plain ASCII
+    // is widened directly, only names with other characters go through the utf8 library
+    if (name.length() <= 255)
     {
-        int i = 0;
-        while (namelen)
+        // No early exit, so the compiler can vectorize the loop
+        BYTE combined = 0;
+        for (size_t i = 0; i < name.length(); i++)
         {
-            temp[i] = towupper(name[i]);
-            i++;
-            namelen--;
+            combined |= static_cast<BYTE>(name[i]);
+            longName[i] = static_cast<BYTE>(name[i]);
         }
-        if (isLongName)
+        if (!(combined & 0x80))
         {
-            temp[6] = '~';
-            temp[7] = '1';
+            length = name.length();
+            return true;
         }
     }
-    
-    shortName = temp;
-    return isLongName;
+
+    if (!utf8::is_valid(name.begin(), name.end()))
+        return false;
+    std::u16string converted;
+    utf8::unchecked::utf8to16(name.begin(), name.end(), std::back_inserter(converted));
+    if (converted.length() > 255)
+        return false;
+    std::copy(converted.begin(), converted.end(), longName);
+    length = converted.length();
+    return true;
 }
 
 static BYTE getShortNameChecksum(BYTE const *shortName)
@@ -258,15 +467,72 @@ static BYTE getShortNameChecksum(BYTE const *shortName)
     return sum;
 }
 
-std::unique_ptr<BYTE[]> Fat::getDirectoryEntry(std::string const& name, bool directory, DWORD firstCluster, DWORD size, std::optional<std::pair<FATDATE, FATTIME>> const& dateTime, DWORD &bufferSize)
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::getUniqueShortName(FatDirectoryNames &names, std::string_view name, std::string &shortName, bool &isLongName, BYTE &caseFlags)
+{
+    // Long names compare case insensitively
+    std::string upperName(name);
+    for (auto &c : upperName)
+        c = std::toupper(static_cast<unsigned char>(c));
+    if (names.LongNames.contains(upperName))
+        return false;
+
+    // A name which is a valid short name must not be the alias of another entry, it would find that entry
+    isLongName = getShortNameBasis(name, shortName, caseFlags);
+    if (!isLongName && names.ShortNames.contains(shortName))
+        return false;
+    if (isLongName)
+    {
+        caseFlags = 0;
+
+        // Windows style: ~1 to ~4 on the first six characters, then two characters and a hash of the long name.
+        // The next tail per basis is remembered so crowded directories do not probe from ~1 every time
+        std::string basis = shortName.substr(0, 6) + shortName.substr(8);
+        DWORD &tail = names.NextTail[basis];
+        tail = std::max<DWORD>(tail, 1);
+
+        std::string alias;
+        bool found = false;
+        while (!found && tail <= 4)
+            found = getNumericTail(shortName, shortName, tail++, alias) && !names.ShortNames.contains(alias);
+
+        if (!found)
+        {
+            static const char hexDigits[] = "0123456789ABCDEF";
+            WORD nameHash = computeHash64(reinterpret_cast<BYTE const*>(name.data()), name.length()) & UINT16_MAX;
+            std::string hashed = shortName.substr(0, std::min<size_t>(shortName.find(' '), 2));
+            for (int i = 3; i >= 0; i--)
+                hashed += hexDigits[(nameHash >> (4 * i)) & 0xF];
+            for (DWORD n = 1; !found && n <= 9; n++)
+                found = getNumericTail(shortName, hashed, n, alias) && !names.ShortNames.contains(alias);
+        }
+
+        // Hash collisions fall back to longer numeric tails
+        while (!found && getNumericTail(shortName, shortName, tail, alias))
+        {
+            found = !names.ShortNames.contains(alias);
+            tail++;
+        }
+
+        if (!found)
+            return false;
+        shortName = alias;
+    }
+
+    names.ShortNames.insert(shortName);
+    names.LongNames.insert(std::move(upperName));
+    return true;
+}
+
+template <DWORD SectorSize>
+std::unique_ptr<BYTE[]> BasicFat<SectorSize>::getDirectoryEntry(std::string_view name, std::string const& shortName, bool isLongName, BYTE caseFlags, bool directory, DWORD firstCluster, DWORD size, std::optional<std::pair<FATDATE, FATTIME>> const& dateTime, DWORD &bufferSize)
 {
     bufferSize = 0;
-    if (name.length() > 255)
+    char16_t longName[LONG_NAME_MAX_SLICES * LONG_NAME_TOTAL_CHARS];
+    DWORD length = 0;
+    if (isLongName && !getLongName(name, longName, length))
         return nullptr;
-    
-    std::string shortName;
-    bool isLongName = getShortName(name, shortName);
-    DWORD longNameEntryCount = isLongName ? (name.length() / 13 + (name.length() % 13 ? 1 : 0)) : 0;
+    DWORD longNameEntryCount = (length + LONG_NAME_TOTAL_CHARS - 1) / LONG_NAME_TOTAL_CHARS;
     bufferSize = longNameEntryCount * sizeof(LONG_DIR_ENTRY) + sizeof(DIR_ENTRY);
 
     auto buff = std::unique_ptr<BYTE[]>(new BYTE[bufferSize]);
@@ -276,86 +542,30 @@ std::unique_ptr<BYTE[]> Fat::getDirectoryEntry(std::string const& name, bool dir
     {
         BYTE checkSum = getShortNameChecksum(reinterpret_cast<BYTE const*>(shortName.c_str()));
 
-        // Generate last entry
-        LONG_DIR_ENTRY *ll = (LONG_DIR_ENTRY *) buff.get();
-        std::memset(ll, 0xFF, sizeof(LONG_DIR_ENTRY));
-        ll->LDIR_Ord = LONG_NAME_ORD_END_MASK | static_cast<BYTE>(longNameEntryCount);
-        ll->LDIR_Attr = ATTR_LONG_NAME;
-        ll->LDIR_Type = 0;
-        ll->LDIR_Chksum = checkSum;
-        ll->LDIR_FstClusLO = 0;
-        DWORD startIndx = (longNameEntryCount - 1) * 13;
-        DWORD lastCharCount = name.length() - startIndx;
-        if (lastCharCount < 13)
-        {
-            if (lastCharCount < 5)
-            {
-                ll->LDIR_Name1[2 * lastCharCount] = 0;
-                ll->LDIR_Name1[2 * lastCharCount + 1] = 0;
-            }
-            else if (lastCharCount < 11)
-            {
-                ll->LDIR_Name2[2 * (lastCharCount - 5)] = 0;
-                ll->LDIR_Name2[2 * (lastCharCount - 5) + 1] = 0;
-            }
-            else
-            {
-                ll->LDIR_Name3[2 * (lastCharCount - 11)] = 0;
-                ll->LDIR_Name3[2 * (lastCharCount - 11) + 1] = 0;
-            }
-        }
-        DWORD entryIndex = 0;
-        for (DWORD i = startIndx; i < startIndx + lastCharCount; i++)
+        // A name that does not fill its last slice is terminated by a NUL and padded with 0xFFFF
+        DWORD paddedLength = longNameEntryCount * LONG_NAME_TOTAL_CHARS;
+        if (length < paddedLength)
         {
-            if (entryIndex < 5)
-            {
-                ll->LDIR_Name1[2 * entryIndex] = name[i];
-                ll->LDIR_Name1[2 * entryIndex + 1] = 0;
-            }
-            else if (entryIndex < 11)
-            {
-                ll->LDIR_Name2[2 * (entryIndex - 5)] = name[i];
-                ll->LDIR_Name2[2 * (entryIndex - 5) + 1] = 0;
-            }
-            else
-            {
-                ll->LDIR_Name3[2 * (entryIndex - 11)] = name[i];
-                ll->LDIR_Name3[2 * (entryIndex - 11) + 1] = 0;
-            }
-            entryIndex++;
+            longName[length] = 0;
+            std::fill(longName + length + 1, longName + paddedLength, 0xFFFF);
         }
 
-        for (DWORD i = 1; i < longNameEntryCount; i++)
+        // Entries are stored last slice first, each slice is scattered into the three name fields
+        for (DWORD i = 0; i < longNameEntryCount; i++)
         {
-            ll = (LONG_DIR_ENTRY *) (buff.get() + i * sizeof(LONG_DIR_ENTRY));
-            ll->LDIR_Ord = longNameEntryCount - i;
+            LONG_DIR_ENTRY *ll = (LONG_DIR_ENTRY *) (buff.get() + i * sizeof(LONG_DIR_ENTRY));
+            DWORD order = longNameEntryCount - i;
+            ll->LDIR_Ord = i ? order : (LONG_NAME_ORD_END_MASK | order);
             ll->LDIR_Attr = ATTR_LONG_NAME;
             ll->LDIR_Type = 0;
             ll->LDIR_Chksum = checkSum;
-            ll->LDIR_FstClusLO = 0; 
+            ll->LDIR_FstClusLO = 0;
 
-            startIndx = (longNameEntryCount - i - 1) * 13;
-            entryIndex = 0;
-            for (DWORD j = startIndx; j < startIndx + 13; j++)
-            {
-                if (entryIndex < 5)
-                {
-                    ll->LDIR_Name1[2 * entryIndex] = name[j];
-                    ll->LDIR_Name1[2 * entryIndex + 1] = 0;
-                }
-                else if (entryIndex < 11)
-                {
-                    ll->LDIR_Name2[2 * (entryIndex - 5)] = name[j];
-                    ll->LDIR_Name2[2 * (entryIndex - 5) + 1] = 0;
-                }
-                else
-                {
-                    ll->LDIR_Name3[2 * (entryIndex - 11)] = name[j];
-                    ll->LDIR_Name3[2 * (entryIndex - 11) + 1] = 0;
-                }
-                entryIndex++;
-            }
-        } 
+            char16_t const *slice = longName + (order - 1) * LONG_NAME_TOTAL_CHARS;
+            std::memcpy(ll->LDIR_Name1, slice, sizeof(ll->LDIR_Name1));
+            std::memcpy(ll->LDIR_Name2, slice + LONG_NAME1_CHARS, sizeof(ll->LDIR_Name2));
+            std::memcpy(ll->LDIR_Name3, slice + LONG_NAME1_CHARS + LONG_NAME2_CHARS, sizeof(ll->LDIR_Name3));
+        }
     }
 
     std::pair<FATDATE, FATTIME> dateTimePair;
@@ -368,6 +578,7 @@ std::unique_ptr<BYTE[]> Fat::getDirectoryEntry(std::string const& name, bool dir
     for (int i = 0; i < 11; i++)
         dirEntry->DIR_Name[i] = shortName[i];
     dirEntry->DIR_Attr = directory ? ATTR_DIRECTORY : ATTR_ARCHIVE;
+    dirEntry->DIR_NTRes = caseFlags;
     dirEntry->DIR_CrtTimeTenth = 0;
     dirEntry->DIR_CrtTime = dateTimePair.second;
     dirEntry->DIR_CrtDate = dateTimePair.first;
@@ -381,34 +592,112 @@ std::unique_ptr<BYTE[]> Fat::getDirectoryEntry(std::string const& name, bool dir
     return buff;
 }
 
-void Fat::openFilesystem()
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::mapFilesystem(BYTE *ptr)
 {
-    assert(sizeof(DIR_ENTRY) == sizeof(LONG_DIR_ENTRY));
+    imageStart = ptr;
+    partitionStart = ptr + partition.StartingLBA * SectorSize;
 
-    BYTE *ptr = static_cast<BYTE *>(openMemoryMappedFile(&file, destination.c_str()));
+    firstFsInfo = partitionStart + firstFsInfoSec * SectorSize;
+    secondFsInfo = partitionStart + secondFsInfoSec * SectorSize;
+
+    fat0 = reinterpret_cast<DWORD *>(partitionStart + reservedSectorCount * SectorSize);
+    fat1 = reinterpret_cast<DWORD *>(partitionStart + reservedSectorCount * SectorSize + fatSize * SectorSize);
+
+    clusterSize = sectorsPerCluster * SectorSize;
+    maxDirEntries = clusterSize / sizeof(DIR_ENTRY);
 
-    partitionStart = ptr + partition.StartingLBA * SECTOR_SIZE;
+    dataStart = partitionStart + reservedSectorCount * SectorSize + numberOfFats * fatSize * SectorSize;
+    clusterEnd = (partition.LBACount - (reservedSectorCount + numberOfFats * fatSize)) / sectorsPerCluster + 2;
+}
 
-    firstFsInfo = partitionStart + firstFsInfoSec * SECTOR_SIZE;
-    secondFsInfo = partitionStart + secondFsInfoSec * SECTOR_SIZE;
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::openFilesystem()
+{
+    assert(sizeof(DIR_ENTRY) == sizeof(LONG_DIR_ENTRY));
 
-    fat0 = reinterpret_cast<DWORD *>(partitionStart + reservedSectorCount * SECTOR_SIZE);
-    fat1 = reinterpret_cast<DWORD *>(partitionStart + reservedSectorCount * SECTOR_SIZE + fatSize * SECTOR_SIZE);
+    BYTE *ptr = static_cast<BYTE *>(openMemoryMappedFile(&file, destination.c_str()));
+    mapFilesystem(ptr);
     
     nextFreeCluster = 3;
     DWORD dataSectors = partition.LBACount - (reservedSectorCount + numberOfFats * fatSize);
     freeClusterCount = dataSectors / sectorsPerCluster - 1; // 1 cluster reserved for the root directory
-    clusterSize = sectorsPerCluster * SECTOR_SIZE;
-    maxDirEntries = clusterSize / sizeof(DIR_ENTRY);
-
-    dataStart = partitionStart + reservedSectorCount * SECTOR_SIZE + numberOfFats * fatSize * SECTOR_SIZE;
 
+    FatDirectory rootDirectory;
     rootDirectory.rawDirectory.self = NULL;
     rootDirectory.rawDirectory.cluster = 2;
     rootDirectory.rawDirectory.entryIndex = 0;
+    rootDirectory.parent = UINT32_MAX;
+    rootDirectory.name = UINT32_MAX;
+    directories.assign(1, rootDirectory);
+    directoryChildren.clear();
+    lastParentPath.clear();
+    lastParent = 0;
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::loadFilesystem()
+{
+    // Opens a filesystem created by a previous run, only files already placed in it can be replaced
+    BYTE *ptr = static_cast<BYTE *>(openMemoryMappedFile(&file, destination.c_str()));
+    if (!ptr)
+        return false;
+
+    FAT_BPB *bpb = reinterpret_cast<FAT_BPB*>(ptr + partition.StartingLBA * SectorSize);
+    if (bpb->Signature != 0xAA55 || bpb->BPB_BytsPerSec != SectorSize || !bpb->BPB_SecPerClus ||
+        bpb->BPB_TotSec32 != static_cast<DWORD>(partition.LBACount))
+    {
+        closeMemoryMappedFile(&file);
+        return false;
+    }
+
+    reservedSectorCount = bpb->BPB_RsvdSecCnt;
+    numberOfFats = bpb->BPB_NumFATs;
+    sectorsPerCluster = bpb->BPB_SecPerClus;
+    fatSize = bpb->DiffOffset.FAT32_BPB.BPB_FATSz32;
+    firstFsInfoSec = bpb->DiffOffset.FAT32_BPB.BPB_FSInfo;
+    secondFsInfoSec = bpb->DiffOffset.FAT32_BPB.BPB_BkBootSec + 1;
+    mapFilesystem(ptr);
+
+    FSINFO *fsInfo = reinterpret_cast<FSINFO*>(firstFsInfo);
+    if (fsInfo->FSI_LeadSig != 0x41615252 || fsInfo->FSI_Free_Count == 0xFFFFFFFF || fsInfo->FSI_Nxt_Free == 0xFFFFFFFF)
+    {
+        closeMemoryMappedFile(&file);
+        return false;
+    }
+    nextFreeCluster = fsInfo->FSI_Nxt_Free;
+    freeClusterCount = fsInfo->FSI_Free_Count;
+
+    return true;
+}
+
+template <DWORD SectorSize>
+QWORD BasicFat<SectorSize>::shrinkFilesystem()
+{
+    // Cuts the data region after the last cluster in use, without going below a valid FAT32 cluster count.
+    // The FATs keep their size, their entries past the new end are free and never used. Returns the new length
+    DWORD lastCluster = clusterEnd - 1;
+    while (lastCluster > 2 && !(fat0[lastCluster] & FAT32_CLUSTER_MASK))
+        lastCluster--;
+
+    DWORD clusterCount = std::max<DWORD>(lastCluster - 1, FAT16_MAX_CLUSTERS);
+    if (clusterCount >= clusterEnd - 2)
+        return partition.LBACount;
+
+    freeClusterCount -= (clusterEnd - 2) - clusterCount;
+    clusterEnd = clusterCount + 2;
+    partition.LBACount = reservedSectorCount + numberOfFats * fatSize + static_cast<QWORD>(clusterCount) * sectorsPerCluster;
+
+    FAT_BPB *bpb = reinterpret_cast<FAT_BPB*>(partitionStart);
+    bpb->BPB_TotSec32 = static_cast<DWORD>(partition.LBACount);
+    FAT_BPB *backupBpb = reinterpret_cast<FAT_BPB*>(partitionStart + bpb->DiffOffset.FAT32_BPB.BPB_BkBootSec * SectorSize);
+    backupBpb->BPB_TotSec32 = bpb->BPB_TotSec32;
+
+    return partition.LBACount;
 }
 
-void Fat::closeFilesystem()
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::syncFilesystem()
 {
     // We write the fs info information because we now know eveything
     // because we created every file and directory
@@ -421,15 +710,26 @@ void Fat::closeFilesystem()
     fsInfo = reinterpret_cast<FSINFO*>(secondFsInfo);
     fsInfo->FSI_Free_Count = freeClusterCount;
     fsInfo->FSI_Nxt_Free = nextFreeCluster;
+}
+
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::closeFilesystem()
+{
+    syncFilesystem();
     
     // Now we can close the file
     closeMemoryMappedFile(&file);
 }
 
-DWORD Fat::allocateClusters(DWORD previousCluster, DWORD clusterCount)
+template <DWORD SectorSize>
+DWORD BasicFat<SectorSize>::allocateClusters(DWORD previousCluster, DWORD clusterCount)
 {
-    if (clusterCount > freeClusterCount)
+    // Clusters set aside for priority files are not available to the rest, and the clusters
+    // skipped to align large files stay free but behind nextFreeCluster
+    if (clusterCount > freeClusterCount - reservedClusterCount)
         return UINT32_MAX;
+    if (nextFreeCluster + clusterCount > clusterEnd)
+        return reservedClusterCount ? UINT32_MAX : allocateFreeClusters(previousCluster, clusterCount);
 
     freeClusterCount -= clusterCount;
 
@@ -458,30 +758,150 @@ DWORD Fat::allocateClusters(DWORD previousCluster, DWORD clusterCount)
     return ret;
 }
 
-BYTE* Fat::getPointerToCluster(DWORD cluster)
+template <DWORD SectorSize>
+DWORD BasicFat<SectorSize>::allocateFreeClusters(DWORD previousCluster, DWORD clusterCount)
 {
-    if (cluster < 2)
-        return nullptr;
-    return dataStart + (cluster - 2) * sectorsPerCluster * SECTOR_SIZE;
+    // Past the end of the bump region, clusters released by updates (or skipped for alignment) are
+    // taken first fit from the start of the data region. The chain may be fragmented. Unconsumed
+    // priority slots are free in the FAT too, so this is never done while any is left
+    std::vector<DWORD> clusters;
+    clusters.reserve(clusterCount);
+    for (DWORD cluster = 2; cluster < clusterEnd && clusters.size() < clusterCount; cluster++)
+    {
+        if (!(fat0[cluster] & FAT32_CLUSTER_MASK))
+            clusters.push_back(cluster);
+    }
+    if (clusters.size() < clusterCount)
+        return UINT32_MAX;
+
+    freeClusterCount -= clusterCount;
+    for (DWORD i = 0; i < clusterCount; i++)
+    {
+        DWORD next = i + 1 < clusterCount ? clusters[i + 1] : FAT32_EOC_MARK;
+        fat0[clusters[i]] = next;
+        fat1[clusters[i]] = next;
+    }
+    if (previousCluster != UINT32_MAX)
+    {
+        fat0[previousCluster] = clusters[0];
+        fat1[previousCluster] = clusters[0];
+    }
+
+    return clusters[0];
 }
 
-std::pair<DWORD, DWORD> Fat::writeFile(std::string const& sourcePath)
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::isContiguousChain(DWORD firstCluster, DWORD clusterCount)
 {
-    std::ifstream in(sourcePath, std::ios::in | std::ios::ate | std::ios::binary);
+    for (DWORD i = 0; i + 1 < clusterCount; i++)
+    {
+        if ((fat0[firstCluster + i] & FAT32_CLUSTER_MASK) != firstCluster + i + 1)
+            return false;
+    }
+    return true;
+}
 
-    QWORD qFileSize = in.tellg();
-    in.seekg(0);
-    if (qFileSize >= UINT32_MAX)
-        return std::make_pair(UINT32_MAX, 0);
+template <DWORD SectorSize>
+DWORD BasicFat<SectorSize>::allocateFileClusters(DWORD clusterCount, std::pair<DWORD, DWORD> const *reservation)
+{
+    if (!reservation)
+    {
+        // Files of at least one erase block start on an erase block boundary, as long as the data region does
+        // The skipped clusters are only given up once the aligned run is allocated
+        QWORD clusterBlock = eraseBlockSize > clusterSize ? eraseBlockSize / clusterSize : 1;
+        if (clusterBlock > 1 && static_cast<QWORD>(clusterCount) * clusterSize >= eraseBlockSize && !((dataStart - imageStart) % eraseBlockSize))
+        {
+            DWORD unalignedCluster = nextFreeCluster;
+            QWORD alignedCluster = nextFreeCluster + (clusterBlock - (nextFreeCluster - 2) % clusterBlock) % clusterBlock;
+            if (alignedCluster + clusterCount <= clusterEnd)
+            {
+                nextFreeCluster = static_cast<DWORD>(alignedCluster);
+                DWORD firstCluster = allocateClusters(UINT32_MAX, clusterCount);
+                if (firstCluster == UINT32_MAX)
+                    nextFreeCluster = unalignedCluster;
+                return firstCluster;
+            }
+        }
+        return allocateClusters(UINT32_MAX, clusterCount);
+    }
 
-    DWORD fileSize = static_cast<DWORD>(qFileSize);
-    DWORD bytesToWrite = fileSize;
-    DWORD clusterCount = fileSize / clusterSize + (fileSize % clusterSize ? 1 : 0); 
+    // The whole slot is released, a source that shrank since it was planned leaves free clusters behind
+    // and one that grew is allocated after everything else
+    reservedClusterCount -= reservation->second;
+    if (clusterCount > reservation->second)
+        return allocateClusters(UINT32_MAX, clusterCount);
 
-    DWORD firstCluster = allocateClusters(UINT32_MAX, clusterCount);  
-    if (firstCluster == UINT32_MAX)
-        return std::make_pair(UINT32_MAX, 0);
+    freeClusterCount -= clusterCount;
+    for (DWORD cluster = reservation->first; cluster < reservation->first + clusterCount - 1; cluster++)
+    {
+        fat0[cluster] = cluster + 1;
+        fat1[cluster] = cluster + 1;
+    }
+    fat0[reservation->first + clusterCount - 1] = FAT32_EOC_MARK;
+    fat1[reservation->first + clusterCount - 1] = FAT32_EOC_MARK;
+
+    return reservation->first;
+}
+
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::freeClusterChain(DWORD cluster)
+{
+    while (cluster >= 2 && !FAT32_EOC(cluster))
+    {
+        DWORD next = fat0[cluster] & FAT32_CLUSTER_MASK;
+        fat0[cluster] = 0;
+        fat1[cluster] = 0;
+        freeClusterCount++;
+        cluster = next;
+    }
+}
+
+template <DWORD SectorSize>
+DWORD BasicFat<SectorSize>::resizeClusterChain(DWORD firstCluster, DWORD clusterCount)
+{
+    // Walk the part of the chain which is kept
+    DWORD keptCount = 0;
+    DWORD lastKept = UINT32_MAX;
+    DWORD cluster = firstCluster;
+    while (cluster >= 2 && !FAT32_EOC(cluster) && keptCount < clusterCount)
+    {
+        lastKept = cluster;
+        keptCount++;
+        cluster = fat0[cluster] & FAT32_CLUSTER_MASK;
+    }
+
+    if (keptCount == clusterCount)
+    {
+        // Same size or smaller, cut the chain and release the tail
+        if (lastKept != UINT32_MAX)
+        {
+            fat0[lastKept] = FAT32_EOC_MARK;
+            fat1[lastKept] = FAT32_EOC_MARK;
+        }
+        freeClusterChain(cluster);
+        return clusterCount ? firstCluster : 0;
+    }
+
+    // Larger, append new clusters to the end of the chain
+    DWORD newCluster = allocateClusters(lastKept, clusterCount - keptCount);
+    if (newCluster == UINT32_MAX)
+        return UINT32_MAX;
+
+    return lastKept == UINT32_MAX ? newCluster : firstCluster;
+}
 
+template <DWORD SectorSize>
+BYTE* BasicFat<SectorSize>::getPointerToCluster(DWORD cluster)
+{
+    if (cluster < 2)
+        return nullptr;
+    return dataStart + static_cast<QWORD>(cluster - 2) * sectorsPerCluster * SectorSize;
+}
+
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::writeFileData(std::istream &in, DWORD firstCluster, DWORD fileSize)
+{
+    DWORD bytesToWrite = fileSize;
     DWORD currentCluster = firstCluster;    
     BYTE *ptr;
     while (bytesToWrite >= clusterSize)
@@ -492,32 +912,156 @@ std::pair<DWORD, DWORD> Fat::writeFile(std::string const& sourcePath)
         currentCluster = fat0[currentCluster];
     }
 
+    if (!bytesToWrite)
+        return;
+
     assert(fat0[currentCluster] == FAT32_EOC_MARK);
     ptr = getPointerToCluster(currentCluster);
     in.read(reinterpret_cast<char*>(ptr), bytesToWrite);
-
-    in.close();
-    return std::make_pair(firstCluster, fileSize);
 }
 
-bool Fat::writeDirectoryEntries(FatRawDirectory &directory, std::unique_ptr<BYTE[]> &entryBuffer, DWORD entryBufferSize)
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::copyCachedSource(SourceCacheEntry const& entry, BYTE *target)
 {
-    DWORD newDirectoryEntryCount = entryBufferSize / sizeof(DIR_ENTRY);
-    DWORD newDirEntriesIndx = 0;
-    DIR_ENTRY *newDirEntries = reinterpret_cast<DIR_ENTRY*>(entryBuffer.get());
-    DIR_ENTRY *dirEntries = reinterpret_cast<DIR_ENTRY*>(getPointerToCluster(directory.cluster));
-    // Fill current cluster
-    for (; directory.entryIndex < maxDirEntries && newDirEntriesIndx < newDirectoryEntryCount; directory.entryIndex++, newDirEntriesIndx++)
-        std::memcpy(&(dirEntries[directory.entryIndex]), &(newDirEntries[newDirEntriesIndx]), sizeof(DIR_ENTRY)); 
+    if (entry.Data)
+    {
+        std::memcpy(target, entry.Data->data(), entry.Size);
+        return true;
+    }
 
-    // Allocate clusters until we are done
-    while (newDirEntriesIndx < newDirectoryEntryCount)
+    if (entry.ImageOffset == UINT64_MAX)
+        return false;
+
+    // Already written to this image, copy it within the mapping
+    if (entry.ImagePath == destination)
     {
-        DWORD newCluster = allocateClusters(directory.cluster, 1);
-        if (newCluster == UINT32_MAX)
+        std::memcpy(target, imageStart + entry.ImageOffset, entry.Size);
+        return true;
+    }
+
+    std::ifstream in(entry.ImagePath, std::ios::in | std::ios::binary);
+    in.seekg(entry.ImageOffset);
+    in.read(reinterpret_cast<char*>(target), entry.Size);
+    return static_cast<QWORD>(in.gcount()) == entry.Size;
+}
+
+template <DWORD SectorSize>
+std::pair<DWORD, DWORD> BasicFat<SectorSize>::writeFile(std::string const& sourcePath, std::pair<DWORD, DWORD> const *reservation)
+{
+    // Sources placed before are served from the cache instead of being read again
+    std::string cacheKey;
+    if (sourceCache)
+    {
+        auto cached = sourceCache->find(sourcePath, cacheKey);
+        if (cached.has_value() && cached->Size < UINT32_MAX)
+        {
+            DWORD fileSize = static_cast<DWORD>(cached->Size);
+            DWORD clusterCount = fileSize / clusterSize + (fileSize % clusterSize ? 1 : 0);
+            if (!clusterCount)
+                return std::make_pair(0, 0);
+
+            // Cached data is copied in one piece, which needs a contiguous chain
+            DWORD firstCluster = allocateFileClusters(clusterCount, reservation);
+            if (firstCluster == UINT32_MAX)
+                return std::make_pair(UINT32_MAX, 0);
+            if (isContiguousChain(firstCluster, clusterCount) && copyCachedSource(cached.value(), getPointerToCluster(firstCluster)))
+            {
+                sourceCache->recordHit(cacheKey, cached.value(), getPointerToCluster(firstCluster));
+                return std::make_pair(firstCluster, fileSize);
+            }
+
+            std::ifstream in(sourcePath, std::ios::in | std::ios::binary);
+            writeFileData(in, firstCluster, fileSize);
+            return std::make_pair(firstCluster, fileSize);
+        }
+    }
+
+    std::ifstream in(sourcePath, std::ios::in | std::ios::ate | std::ios::binary);
+    if (!in.is_open())
+        return std::make_pair(UINT32_MAX, 0);
+
+    QWORD qFileSize = in.tellg();
+    in.seekg(0);
+    if (qFileSize >= UINT32_MAX)
+        return std::make_pair(UINT32_MAX, 0);
+
+    DWORD fileSize = static_cast<DWORD>(qFileSize);
+    DWORD clusterCount = fileSize / clusterSize + (fileSize % clusterSize ? 1 : 0); 
+
+    // Empty files have no cluster chain
+    if (!clusterCount)
+        return std::make_pair(0, 0);
+
+    DWORD firstCluster = allocateFileClusters(clusterCount, reservation);  
+    if (firstCluster == UINT32_MAX)
+        return std::make_pair(UINT32_MAX, 0);
+
+    writeFileData(in, firstCluster, fileSize);
+
+    in.close();
+
+    if (sourceCache && isContiguousChain(firstCluster, clusterCount))
+    {
+        BYTE *data = getPointerToCluster(firstCluster);
+        sourceCache->insert(cacheKey, fileSize, data, destination, data - imageStart);
+    }
+
+    return std::make_pair(firstCluster, fileSize);
+}
+
+template <DWORD SectorSize>
+std::pair<DWORD, DWORD> BasicFat<SectorSize>::preallocateFile(DWORD fileSize, std::optional<BYTE> fill, std::pair<DWORD, DWORD> const *reservation)
+{
+    // Only the cluster chain is written. The image is created sparse and clusters are handed out once,
+    // so the data of the file stays a hole that reads as zero unless a fill byte is asked for
+    DWORD clusterCount = fileSize / clusterSize + (fileSize % clusterSize ? 1 : 0);
+    if (!clusterCount)
+        return std::make_pair(0, 0);
+
+    DWORD firstCluster = allocateFileClusters(clusterCount, reservation);
+    if (firstCluster == UINT32_MAX)
+        return std::make_pair(UINT32_MAX, 0);
+
+    // Chains of reused clusters may hold old data, they are always written
+    bool contiguous = isContiguousChain(firstCluster, clusterCount);
+    if (contiguous && fill.value_or(0))
+        std::memset(getPointerToCluster(firstCluster), fill.value(), fileSize);
+    else if (!contiguous)
+    {
+        for (DWORD cluster = firstCluster; !FAT32_EOC(cluster); cluster = fat0[cluster] & FAT32_CLUSTER_MASK)
+            std::memset(getPointerToCluster(cluster), fill.value_or(0), clusterSize);
+    }
+
+    return std::make_pair(firstCluster, fileSize);
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::writeDirectoryEntries(FatRawDirectory &directory, std::unique_ptr<BYTE[]> &entryBuffer, DWORD entryBufferSize, std::vector<DWORD> *clusters)
+{
+    // clusters receives every cluster written to, starting with the current one
+    if (clusters)
+        clusters->push_back(directory.cluster);
+
+    DWORD newDirectoryEntryCount = entryBufferSize / sizeof(DIR_ENTRY);
+    DWORD newDirEntriesIndx = 0;
+    DIR_ENTRY *newDirEntries = reinterpret_cast<DIR_ENTRY*>(entryBuffer.get());
+    DIR_ENTRY *dirEntries = reinterpret_cast<DIR_ENTRY*>(getPointerToCluster(directory.cluster));
+    // Fill current cluster
+    for (; directory.entryIndex < maxDirEntries && newDirEntriesIndx < newDirectoryEntryCount; directory.entryIndex++, newDirEntriesIndx++)
+        std::memcpy(&(dirEntries[directory.entryIndex]), &(newDirEntries[newDirEntriesIndx]), sizeof(DIR_ENTRY)); 
+
+    // Continue into reserved clusters first, allocate once the chain runs out
+    while (newDirEntriesIndx < newDirectoryEntryCount)
+    {
+        DWORD newCluster = fat0[directory.cluster] & FAT32_CLUSTER_MASK;
+        if (FAT32_EOC(newCluster))
+            newCluster = allocateClusters(directory.cluster, 1);
+        if (newCluster == UINT32_MAX)
             return false;
         directory.cluster = newCluster;
         directory.entryIndex = 0;
+        if (clusters)
+            clusters->push_back(newCluster);
         dirEntries = reinterpret_cast<DIR_ENTRY*>(getPointerToCluster(newCluster));
         for (; directory.entryIndex < maxDirEntries && newDirEntriesIndx < newDirectoryEntryCount; directory.entryIndex++, newDirEntriesIndx++)
             std::memcpy(&(dirEntries[directory.entryIndex]), &(newDirEntries[newDirEntriesIndx]), sizeof(DIR_ENTRY));
@@ -526,24 +1070,55 @@ bool Fat::writeDirectoryEntries(FatRawDirectory &directory, std::unique_ptr<BYTE
     return true;
 }
 
-bool Fat::createRawFile(FatRawDirectory &directory, std::string const& filename, std::string const& sourcePath)
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::writeFileEntry(FatDirectory &parent, std::string_view filename, std::string const& shortName, bool isLongName, BYTE caseFlags, std::pair<DWORD, DWORD> loadedFile, std::pair<FATDATE, FATTIME> const& dateTime, FatFilePlacement &placement)
 {
-    auto loadedFile = writeFile(sourcePath); 
-    if (loadedFile.first == UINT32_MAX)
-         return false;
-
     DWORD entryBufferSize;
-    auto entryBuffer = getDirectoryEntry(filename, false, loadedFile.first, loadedFile.second, {}, entryBufferSize);
+    auto entryBuffer = getDirectoryEntry(filename, shortName, isLongName, caseFlags, false, loadedFile.first, loadedFile.second, dateTime, entryBufferSize);
     if (!entryBuffer.get())
         return false;
    
-    return writeDirectoryEntries(directory, entryBuffer, entryBufferSize);
+    FatRawDirectory &directory = parent.rawDirectory;
+    if (!writeDirectoryEntries(directory, entryBuffer, entryBufferSize))
+        return false;
+
+    // The short entry is always the last one written
+    DIR_ENTRY *entry = &((reinterpret_cast<DIR_ENTRY*>(getPointerToCluster(directory.cluster)))[directory.entryIndex - 1]);
+    placement.FirstCluster = loadedFile.first;
+    placement.Size = loadedFile.second;
+    placement.EntryOffset = reinterpret_cast<BYTE*>(entry) - partitionStart;
+
+    return true;
 }
 
-std::optional<Fat::FatRawDirectory> Fat::createRawDirectory(FatRawDirectory &parent, std::string const& directoryName)
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::createRawFile(FatDirectory &parent, std::string_view filename, std::string const& sourcePath, FatFilePlacement &placement)
 {
+    std::string shortName;
+    bool isLongName;
+    BYTE caseFlags;
+    if (!getUniqueShortName(parent.names, filename, shortName, isLongName, caseFlags))
+        return false;
+
+    auto loadedFile = writeFile(sourcePath); 
+    if (loadedFile.first == UINT32_MAX)
+         return false;
+
+    return writeFileEntry(parent, filename, shortName, isLongName, caseFlags, loadedFile, getFileDateAndTime(sourcePath), placement);
+}
+
+template <DWORD SectorSize>
+std::optional<typename BasicFat<SectorSize>::FatRawDirectory> BasicFat<SectorSize>::createRawDirectory(FatDirectory &parentDirectory, std::string_view directoryName, DWORD reservedCluster)
+{
+    std::string shortName;
+    bool isLongName;
+    BYTE caseFlags;
+    if (!getUniqueShortName(parentDirectory.names, directoryName, shortName, isLongName, caseFlags))
+        return {};
+
     // Prepare . and .. for the new directory
-    DWORD newCluster = allocateClusters(UINT32_MAX, 1);  
+    FatRawDirectory &parent = parentDirectory.rawDirectory;
+    DWORD newCluster = reservedCluster != UINT32_MAX ? reservedCluster : allocateClusters(UINT32_MAX, 1);  
     if (newCluster == UINT32_MAX)
         return {};
     
@@ -581,7 +1156,7 @@ std::optional<Fat::FatRawDirectory> Fat::createRawDirectory(FatRawDirectory &par
 
     // Create directory entry in the parent
     DWORD entryBufferSize;
-    auto entryBuffer = getDirectoryEntry(directoryName, true, newCluster, 0, dateTime, entryBufferSize);
+    auto entryBuffer = getDirectoryEntry(directoryName, shortName, isLongName, caseFlags, true, newCluster, 0, dateTime, entryBufferSize);
     if (!entryBuffer.get())
         return {};
     
@@ -597,63 +1172,838 @@ std::optional<Fat::FatRawDirectory> Fat::createRawDirectory(FatRawDirectory &par
     return ret;
 }
 
-Fat::FatDirectory* Fat::findDirectory(std::string const& path)
+template <DWORD SectorSize>
+DWORD BasicFat<SectorSize>::internName(std::string_view name)
 {
-    if (path.empty())
-        return &rootDirectory;
+    auto it = internedNames.find(name);
+    if (it != internedNames.end())
+        return it->second;
 
-    std::stringstream ss(path);
-    std::string dir;
-    FatDirectory *cwd = &rootDirectory;
+    // Names are copied once into large blocks, the views handed out stay valid until the Fat is destroyed
+    if (nameBlocks.empty() || nameBlockUsed + name.size() > FAT_NAME_BLOCK_SIZE)
+    {
+        nameBlocks.push_back(std::unique_ptr<char[]>(new char[std::max<size_t>(FAT_NAME_BLOCK_SIZE, name.size())]));
+        nameBlockUsed = 0;
+    }
+    char *copy = nameBlocks.back().get() + nameBlockUsed;
+    std::memcpy(copy, name.data(), name.size());
+    nameBlockUsed += name.size();
+    nameBytes += name.size();
+
+    DWORD id = internedNames.size();
+    internedNames.emplace(std::string_view(copy, name.size()), id);
+    return id;
+}
 
-    while(!ss.eof())
+template <DWORD SectorSize>
+DWORD BasicFat<SectorSize>::findDirectory(std::string_view path)
+{
+    // path is relative to the root, without the leading slash
+    DWORD cwd = 0;
+    while (!path.empty())
     {
-        std::getline(ss, dir, '/');
-        auto it = cwd->children.find(dir);
-        if (it == cwd->children.end())
-            return nullptr;
-        cwd = &(it->second);
+        size_t slash = path.find('/');
+        std::string_view component = path.substr(0, slash);
+        pathStatistics.components++;
+
+        auto name = internedNames.find(component);
+        if (name == internedNames.end())
+            return UINT32_MAX;
+        auto child = directoryChildren.find((static_cast<QWORD>(cwd) << 32) | name->second);
+        if (child == directoryChildren.end())
+            return UINT32_MAX;
+        cwd = child->second;
+
+        if (slash == std::string_view::npos)
+            break;
+        path.remove_prefix(slash + 1);
+        if (path.empty())
+            return UINT32_MAX;
     }
 
     return cwd;
 }
 
-bool Fat::createDirectory(std::string const& path)
+template <DWORD SectorSize>
+DWORD BasicFat<SectorSize>::findParentDirectory(std::string_view path, std::string_view &name)
 {
+    auto start = std::chrono::steady_clock::now();
+    pathStatistics.lookups++;
+
     size_t lastSlash = path.find_last_of('/');
-    std::string parent;
-    if (lastSlash == 0)
-        parent = "";
+    if (path.empty() || path[0] != '/' || lastSlash == std::string_view::npos)
+        return UINT32_MAX;
+    name = path.substr(lastSlash + 1);
+    std::string_view parent = lastSlash ? path.substr(1, lastSlash - 1) : std::string_view();
+
+    // Sorted inputs keep hitting the same parent
+    DWORD ret;
+    if (parent == lastParentPath)
+    {
+        pathStatistics.cacheHits++;
+        ret = lastParent;
+    }
     else
-        parent = path.substr(1, lastSlash - 1);
-    std::string name = path.substr(lastSlash + 1, std::string::npos);
+    {
+        ret = findDirectory(parent);
+        if (ret != UINT32_MAX)
+        {
+            lastParentPath = parent;
+            lastParent = ret;
+        }
+    }
 
-    FatDirectory *pDir = findDirectory(parent);
-    if (!pDir)
+    pathStatistics.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    return ret;
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::createDirectory(std::string const& path)
+{
+    std::string_view name;
+    DWORD parent = findParentDirectory(path, name);
+    if (parent == UINT32_MAX || name.empty())
         return false;
 
-    std::optional<FatRawDirectory> rawDirOpt = createRawDirectory(pDir->rawDirectory, name);
+    DWORD reservedCluster = UINT32_MAX;
+    auto reservation = reservedDirectoryClusters.find(path.substr(1));
+    if (reservation != reservedDirectoryClusters.end())
+    {
+        reservedCluster = reservation->second;
+        reservedDirectoryClusters.erase(reservation);
+    }
+
+    std::optional<FatRawDirectory> rawDirOpt = createRawDirectory(directories[parent], name, reservedCluster);
     if (!rawDirOpt.has_value())
         return false;
 
-    pDir->children[name].rawDirectory = rawDirOpt.value();
+    FatDirectory directory;
+    directory.rawDirectory = rawDirOpt.value();
+    directory.parent = parent;
+    directory.name = internName(name);
+    directoryChildren[(static_cast<QWORD>(parent) << 32) | directory.name] = directories.size();
+    directories.push_back(directory);
 
     return true;
 }
 
-bool Fat::createFile(std::string const& destinationPath, std::string const& sourcePath)
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::createFile(std::string const& destinationPath, std::string const& sourcePath)
 {
-    size_t lastSlash = destinationPath.find_last_of('/');
-    std::string parent;
-    if (lastSlash == 0)
-        parent = "";
-    else
-        parent = destinationPath.substr(1, lastSlash - 1);
-    std::string name = destinationPath.substr(lastSlash + 1, std::string::npos);
+    std::string_view name;
+    DWORD parent = findParentDirectory(destinationPath, name);
+    if (parent == UINT32_MAX || name.empty())
+        return false;
+
+    FatFilePlacement placement;
+    if (!createRawFile(directories[parent], name, sourcePath, placement))
+        return false;
+
+    filePlacements[destinationPath] = placement;
+    return true;
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::createFile(std::string const& destinationPath, std::istream &in, DWORD size, std::time_t modificationTime)
+{
+    // For sources without a path, such as archive members: exactly size bytes are read from the stream
+    // straight into the new chain
+    std::string_view name;
+    DWORD parent = findParentDirectory(destinationPath, name);
+    if (parent == UINT32_MAX || name.empty())
+        return false;
+
+    std::string shortName;
+    bool isLongName;
+    BYTE caseFlags;
+    if (!getUniqueShortName(directories[parent].names, name, shortName, isLongName, caseFlags))
+        return false;
+
+    DWORD clusterCount = size / clusterSize + (size % clusterSize ? 1 : 0);
+    DWORD firstCluster = 0;
+    if (clusterCount)
+    {
+        firstCluster = allocateFileClusters(clusterCount, nullptr);
+        if (firstCluster == UINT32_MAX)
+            return false;
+        writeFileData(in, firstCluster, size);
+        if (!in)
+            return false;
+    }
+
+    FatFilePlacement placement;
+    auto dateTime = reproducible && !fixedTimestamp.has_value() ? getDateAndTime(modificationTime) : getCurrentDateAndTime();
+    if (!writeFileEntry(directories[parent], name, shortName, isLongName, caseFlags, std::make_pair(firstCluster, size), dateTime, placement))
+        return false;
+
+    filePlacements[destinationPath] = placement;
+    return true;
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::duplicateFile(std::string const& destinationPath, std::string const& existingPath, std::time_t modificationTime)
+{
+    // FAT has no links, the data of a file already written is copied cluster by cluster into a new chain
+    auto existing = filePlacements.find(existingPath);
+    if (existing == filePlacements.end())
+        return false;
+    DWORD size = existing->second.Size;
+    DWORD sourceCluster = existing->second.FirstCluster;
+
+    std::string_view name;
+    DWORD parent = findParentDirectory(destinationPath, name);
+    if (parent == UINT32_MAX || name.empty())
+        return false;
+
+    std::string shortName;
+    bool isLongName;
+    BYTE caseFlags;
+    if (!getUniqueShortName(directories[parent].names, name, shortName, isLongName, caseFlags))
+        return false;
+
+    DWORD clusterCount = size / clusterSize + (size % clusterSize ? 1 : 0);
+    DWORD firstCluster = 0;
+    if (clusterCount)
+    {
+        firstCluster = allocateFileClusters(clusterCount, nullptr);
+        if (firstCluster == UINT32_MAX)
+            return false;
+        for (DWORD i = 0, cluster = firstCluster; i < clusterCount; i++)
+        {
+            std::memcpy(getPointerToCluster(cluster), getPointerToCluster(sourceCluster), clusterSize);
+            cluster = fat0[cluster] & FAT32_CLUSTER_MASK;
+            sourceCluster = fat0[sourceCluster] & FAT32_CLUSTER_MASK;
+        }
+    }
+
+    FatFilePlacement placement;
+    auto dateTime = reproducible && !fixedTimestamp.has_value() ? getDateAndTime(modificationTime) : getCurrentDateAndTime();
+    if (!writeFileEntry(directories[parent], name, shortName, isLongName, caseFlags, std::make_pair(firstCluster, size), dateTime, placement))
+        return false;
+
+    filePlacements[destinationPath] = placement;
+    return true;
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::ensureDirectory(std::string const& path)
+{
+    // Creates the directory and every missing parent, existing ones are left alone
+    if (path.empty() || path[0] != '/')
+        return false;
+
+    for (size_t end = path.find('/', 1); ; end = path.find('/', end + 1))
+    {
+        std::string prefix = path.substr(0, end);
+        if (findDirectory(std::string_view(prefix).substr(1)) == UINT32_MAX && !createDirectory(prefix))
+            return false;
+        if (end == std::string::npos)
+            return true;
+    }
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::isValidName(std::string_view name)
+{
+    // What a long name may hold: valid UTF-8 of at most 255 UTF-16 units, no control characters
+    // and none of the characters reserved by FAT. Names made of dots alone would shadow . and ..
+    char16_t longName[LONG_NAME_MAX_SLICES * LONG_NAME_TOTAL_CHARS];
+    DWORD length;
+    if (name.empty() || name.find_first_not_of('.') == std::string_view::npos || !getLongName(name, longName, length))
+        return false;
+    return std::none_of(name.begin(), name.end(), [](char c) { return static_cast<BYTE>(c) < 0x20 || std::strchr("\"*/:<>?\\|", c); });
+}
+
+static DWORD getDirectoryEntryCount(std::string_view name)
+{
+    std::string shortName;
+    BYTE caseFlags;
+    char16_t longName[255];
+    DWORD length;
+    if (!getShortNameBasis(name, shortName, caseFlags) || !getLongName(name, longName, length))
+        return 1;
+    return 1 + (length + LONG_NAME_TOTAL_CHARS - 1) / LONG_NAME_TOTAL_CHARS;
+}
+
+static bool getDirectoryEntryCounts(std::span<std::string const> directoryPaths, std::span<FatFileSpec const> files, FatEntryCounts &entryCounts)
+{
+    // Entries per directory, keyed by path without the leading slash
+    auto addEntry = [&entryCounts](std::string_view path) -> bool
+    {
+        size_t lastSlash = path.find_last_of('/');
+        if (path.empty() || path[0] != '/' || lastSlash == path.length() - 1)
+            return false;
+        entryCounts[lastSlash ? path.substr(1, lastSlash - 1) : std::string_view()] += getDirectoryEntryCount(path.substr(lastSlash + 1));
+        return true;
+    };
+
+    for (auto const &path : directoryPaths)
+    {
+        if (!addEntry(path))
+            return false;
+        entryCounts[std::string_view(path).substr(1)] += 2; // . and ..
+    }
+    for (auto const &file : files)
+    {
+        if (!addEntry(file.Destination))
+            return false;
+    }
+
+    return true;
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::reserveLayout(std::span<std::string const> directoryPaths, std::span<FatFileSpec const> files)
+{
+    FatEntryCounts entryCounts;
+    if (!getDirectoryEntryCounts(directoryPaths, files, entryCounts))
+        return false;
+
+    // Every chain is allocated before any file data, so directories sit next to each other
+    // near the start of the data region, in the order they are listed
+    DWORD rootEntries = entryCounts[std::string_view()];
+    DWORD rootClusters = std::max<DWORD>(1, rootEntries / maxDirEntries + (rootEntries % maxDirEntries ? 1 : 0));
+    if (resizeClusterChain(directories[0].rawDirectory.cluster, rootClusters) == UINT32_MAX)
+        return false;
+
+    // Priority files follow the root directory, lowest priority value first. Their clusters are
+    // only set aside here, the chains are written when the files are created
+    std::vector<FatFileSpec const*> priorityFiles;
+    for (auto const &file : files)
+    {
+        if (file.Priority.has_value())
+            priorityFiles.push_back(&file);
+    }
+    std::stable_sort(priorityFiles.begin(), priorityFiles.end(), [](FatFileSpec const *a, FatFileSpec const *b) { return a->Priority.value() < b->Priority.value(); });
+
+    for (auto const *file : priorityFiles)
+    {
+        std::error_code error;
+        QWORD fileSize = file->Size.has_value() ? file->Size.value() : std::filesystem::file_size(file->Source, error);
+        if (error)
+            continue;
+        QWORD clusters = fileSize / clusterSize + (fileSize % clusterSize ? 1 : 0);
+        if (clusters > freeClusterCount - reservedClusterCount)
+            return false;
+        reservedFileClusters[std::string(file->Destination)] = std::make_pair(nextFreeCluster, static_cast<DWORD>(clusters));
+        nextFreeCluster += clusters;
+        reservedClusterCount += clusters;
+    }
+
+    for (auto const &path : directoryPaths)
+    {
+        DWORD entries = entryCounts[std::string_view(path).substr(1)];
+        DWORD clusters = entries / maxDirEntries + (entries % maxDirEntries ? 1 : 0);
+        DWORD firstCluster = allocateClusters(UINT32_MAX, clusters);
+        if (firstCluster == UINT32_MAX)
+            return false;
+        reservedDirectoryClusters[path.substr(1)] = firstCluster;
+    }
+
+    return true;
+}
+
+static bool getContentSizes(std::span<std::string const> directoryPaths, std::span<FatFileSpec const> files, FatEntryCounts &entryCounts, std::vector<QWORD> &fileSizes)
+{
+    if (!getDirectoryEntryCounts(directoryPaths, files, entryCounts))
+        return false;
+    entryCounts.try_emplace(std::string_view(), 0);
+
+    fileSizes.reserve(files.size());
+    for (auto const &file : files)
+    {
+        std::error_code error;
+        QWORD fileSize = file.Size.has_value() ? file.Size.value() : std::filesystem::file_size(file.Source, error);
+        if (error)
+            return false;
+        fileSizes.push_back(fileSize);
+    }
+
+    return true;
+}
+
+static QWORD getContentClusters(FatEntryCounts const &entryCounts, std::vector<QWORD> const &fileSizes, QWORD clusterSize, QWORD &contentBytes)
+{
+    // Every directory takes at least one cluster, the root included
+    QWORD clusters = 0;
+    contentBytes = 0;
+    for (QWORD fileSize : fileSizes)
+    {
+        clusters += (fileSize + clusterSize - 1) / clusterSize;
+        contentBytes += fileSize;
+    }
+    for (auto const &[path, entries] : entryCounts)
+    {
+        QWORD directoryBytes = static_cast<QWORD>(entries) * sizeof(DIR_ENTRY);
+        clusters += std::max<QWORD>(1, (directoryBytes + clusterSize - 1) / clusterSize);
+        contentBytes += directoryBytes;
+    }
+
+    return clusters;
+}
+
+// Bytes charged for every cluster of a chain, each one is another FAT lookup when the file is read
+#define FAT_CLUSTER_LINK_COST 64
+
+// Larger clusters are valid but not supported by every implementation
+#define FAT_MAX_AUTO_CLUSTER_SIZE (32 * 1024)
+
+template <DWORD SectorSize>
+std::optional<DWORD> BasicFat<SectorSize>::optimizeClusterSize(std::span<std::string const> directoryPaths, std::span<FatFileSpec const> files, bool report)
+{
+    // Must be called before createFilesystem. Every cluster size giving a valid FAT32 cluster count that
+    // fits the content is scored by the space taken by the reserved area and the FATs, the slack at
+    // the end of every chain and the number of clusters in the chains, the cheapest one is kept
+    typedef struct
+    {
+        DWORD ReservedSectors;
+        DWORD FatSectors;
+        DWORD ClusterCount;
+        QWORD UsedClusters;
+        QWORD Slack; // bytes
+        QWORD Cost; // bytes
+    } FatGeometryCost;
+
+    FatEntryCounts entryCounts;
+    std::vector<QWORD> fileSizes;
+    if (!getContentSizes(directoryPaths, files, entryCounts, fileSizes))
+        return std::nullopt;
+
+    auto evaluate = [&](DWORD clusterSectors, FatGeometryCost &cost) -> bool
+    {
+        QWORD size = clusterSectors * SectorSize;
+        cost.ReservedSectors = FAT_RESERVED_SECTORS;
+        if (!computeGeometry(clusterSectors, cost.ReservedSectors, cost.FatSectors, cost.ClusterCount) ||
+            cost.ClusterCount < FAT16_MAX_CLUSTERS || cost.ClusterCount > FAT32_MAX_CLUSTERS)
+            return false;
+
+        QWORD usedBytes;
+        cost.UsedClusters = getContentClusters(entryCounts, fileSizes, size, usedBytes);
+        if (cost.UsedClusters > cost.ClusterCount)
+            return false;
+
+        cost.Slack = cost.UsedClusters * size - usedBytes;
+        cost.Cost = (static_cast<QWORD>(cost.ReservedSectors) + numberOfFats * cost.FatSectors) * SectorSize +
+            cost.Slack + cost.UsedClusters * FAT_CLUSTER_LINK_COST;
+        return true;
+    };
+
+    std::optional<DWORD> best;
+    FatGeometryCost bestCost = {};
+    for (DWORD clusterSectors = 1; clusterSectors * SectorSize <= FAT_MAX_AUTO_CLUSTER_SIZE; clusterSectors *= 2)
+    {
+        FatGeometryCost cost;
+        if (evaluate(clusterSectors, cost) && (!best.has_value() || cost.Cost < bestCost.Cost))
+        {
+            best = clusterSectors * SectorSize;
+            bestCost = cost;
+        }
+    }
+    if (!report)
+        return best;
+    if (!best.has_value())
+    {
+        std::cout << "no cluster size up to " << FAT_MAX_AUTO_CLUSTER_SIZE << " bytes gives a valid FAT32 cluster count that fits the content" << std::endl;
+        return std::nullopt;
+    }
+
+    std::cout << "cluster size " << best.value() << " bytes, " << bestCost.ClusterCount << " clusters, " << numberOfFats << " FATs of "
+        << bestCost.FatSectors << " sectors, " << bestCost.ReservedSectors << " reserved sectors; " << bestCost.UsedClusters
+        << " clusters used, " << bestCost.Slack / 1024 << " KiB slack";
+
+    // Compared against the cluster size the partition size table would have picked
+    DWORD tableSectors = getDefaultSectorsPerCluster();
+    FatGeometryCost tableCost;
+    if (tableSectors * SectorSize == best.value())
+        std::cout << ", same as the partition size table";
+    else if (tableSectors && evaluate(tableSectors, tableCost))
+    {
+        // The space saved only counts real bytes, the cost also charges every chain cluster
+        INT64 fatDelta = (static_cast<INT64>(bestCost.ReservedSectors) + static_cast<INT64>(numberOfFats) * bestCost.FatSectors -
+            tableCost.ReservedSectors - static_cast<INT64>(numberOfFats) * tableCost.FatSectors) * SectorSize;
+        INT64 slackDelta = static_cast<INT64>(bestCost.Slack) - static_cast<INT64>(tableCost.Slack);
+        INT64 saved = -(fatDelta + slackDelta);
+        std::cout << "; " << (saved < 0 ? -saved : saved) / 1024 << (saved < 0 ? " KiB more space used than " : " KiB saved over ")
+            << tableSectors * SectorSize << " byte clusters (FATs " << std::showpos << fatDelta / 1024 << " KiB, slack "
+            << slackDelta / 1024 << " KiB, chain clusters "
+            << static_cast<INT64>(bestCost.UsedClusters) - static_cast<INT64>(tableCost.UsedClusters) << std::noshowpos << "), cost "
+            << (static_cast<INT64>(tableCost.Cost) - static_cast<INT64>(bestCost.Cost)) / 1024 << " KiB lower";
+    }
+    std::cout << std::endl;
+
+    return best;
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::estimateLayout(std::span<std::string const> directoryPaths, std::span<FatFileSpec const> files, FatLayoutEstimate &estimate)
+{
+    // The geometry createFilesystem would pick and the space the content would take in it,
+    // from the sizes of the sources alone. Nothing is written
+    FatEntryCounts entryCounts;
+    std::vector<QWORD> fileSizes;
+    if (!getContentSizes(directoryPaths, files, entryCounts, fileSizes))
+        return false;
+
+    DWORD clusterSectors = requestedClusterSize ? requestedClusterSize / SectorSize : getDefaultSectorsPerCluster();
+    estimate.ReservedSectors = FAT_RESERVED_SECTORS;
+    if (!clusterSectors || !computeGeometry(clusterSectors, estimate.ReservedSectors, estimate.FatSectors, estimate.ClusterCount))
+        return false;
+
+    QWORD size = clusterSectors * SectorSize;
+    QWORD clusterBlock = eraseBlockSize > size ? eraseBlockSize / size : 1;
+    estimate.ClusterSize = size;
+    estimate.Files = files.size();
+    estimate.Directories = entryCounts.size();
+    estimate.FileClusters = 0;
+    estimate.FileBytes = 0;
+    estimate.PaddingClusters = 0;
+    QWORD dataBytes = 0;
+    for (size_t i = 0; i < fileSizes.size(); i++)
+    {
+        QWORD fileSize = fileSizes[i];
+        estimate.FileClusters += (fileSize + size - 1) / size;
+        estimate.FileBytes += fileSize;
+        if (clusterBlock > 1 && fileSize >= eraseBlockSize)
+            estimate.PaddingClusters += clusterBlock - 1;
+
+        // Preallocated files cost their chain alone unless they are filled
+        if (!files[i].Source.empty() || files[i].Fill.value_or(0))
+            dataBytes += fileSize;
+    }
+
+    QWORD contentBytes;
+    estimate.DirectoryClusters = getContentClusters(entryCounts, {}, size, contentBytes);
+    estimate.Slack = (estimate.FileClusters + estimate.DirectoryClusters) * size - estimate.FileBytes - contentBytes;
+
+    QWORD usedClusters = estimate.FileClusters + estimate.DirectoryClusters + estimate.PaddingClusters;
+    estimate.Fits = usedClusters <= estimate.ClusterCount;
+    estimate.FreeClusters = estimate.Fits ? estimate.ClusterCount - usedClusters : 0;
+
+    // Both boot sectors and FSInfo sectors, and the FAT entries of every allocated cluster in each FAT
+    estimate.BytesWritten = 4 * SectorSize + numberOfFats * (estimate.FileClusters + estimate.DirectoryClusters + 2) * sizeof(DWORD) +
+        estimate.DirectoryClusters * size + dataBytes;
+    return true;
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::planFilesystem(std::span<std::string const> directoryPaths, std::span<FatFileSpec const> files, DWORD headroom, DWORD eraseBlockSize, DWORD &clusterSize, QWORD &lbaCount)
+{
+    // Smallest partition holding the content and headroom percent more clusters, with a valid FAT32
+    // cluster count. A given cluster size is kept, otherwise the one giving the smallest partition wins
+    FatEntryCounts entryCounts;
+    std::vector<QWORD> fileSizes;
+    if (!getContentSizes(directoryPaths, files, entryCounts, fileSizes))
+        return false;
+
+    // The reserved area may grow by up to one erase block and so may the start of every large file
+    DWORD paddingSectors = eraseBlockSize > SectorSize ? eraseBlockSize / SectorSize : 0;
+    DWORD requestedSize = clusterSize;
+    std::optional<QWORD> best;
+    for (DWORD clusterSectors = 1; clusterSectors * SectorSize <= std::max<DWORD>(requestedSize, FAT_MAX_AUTO_CLUSTER_SIZE); clusterSectors *= 2)
+    {
+        if (requestedSize && clusterSectors * SectorSize != requestedSize)
+            continue;
+
+        QWORD contentBytes;
+        QWORD clusters = getContentClusters(entryCounts, fileSizes, clusterSectors * SectorSize, contentBytes);
+        if (paddingSectors > clusterSectors)
+        {
+            for (QWORD fileSize : fileSizes)
+                clusters += fileSize >= eraseBlockSize ? paddingSectors / clusterSectors - 1 : 0;
+        }
+        clusters = std::max<QWORD>((clusters * (100 + headroom) + 99) / 100, FAT16_MAX_CLUSTERS);
+        if (clusters > FAT32_MAX_CLUSTERS)
+            continue;
+
+        // The FAT size formula overestimates, grow the partition until it really holds that many clusters
+        QWORD fatSectors = ((clusters + 2) * sizeof(DWORD) + SectorSize - 1) / SectorSize;
+        QWORD sectors = FAT_RESERVED_SECTORS + paddingSectors + FAT_NUMBER_OF_FATS * fatSectors + clusters * clusterSectors;
+        while (sectors <= UINT32_MAX)
+        {
+            fatSectors = computeFatSizeInSectors(sectors, FAT_RESERVED_SECTORS, clusterSectors);
+            QWORD available = (sectors - FAT_RESERVED_SECTORS - paddingSectors - FAT_NUMBER_OF_FATS * fatSectors) / clusterSectors;
+            if (available >= clusters)
+                break;
+            sectors += (clusters - available) * clusterSectors;
+        }
+        if (sectors > UINT32_MAX)
+            continue;
+
+        if (!best.has_value() || sectors < best.value())
+        {
+            best = sectors;
+            lbaCount = sectors;
+            clusterSize = clusterSectors * SectorSize;
+        }
+    }
+
+    return best.has_value();
+}
+
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::getChainFragmentation(DWORD firstCluster, QWORD &clusters, QWORD &fragments)
+{
+    DWORD previous = UINT32_MAX;
+    for (DWORD cluster = firstCluster; cluster >= 2 && !FAT32_EOC(cluster); cluster = fat0[cluster] & FAT32_CLUSTER_MASK)
+    {
+        clusters++;
+        if (cluster != previous + 1)
+            fragments++;
+        previous = cluster;
+    }
+}
 
-    FatDirectory *pDir = findDirectory(parent);
-    if (!pDir)
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::createFiles(std::span<FatFileSpec const> files)
+{
+    typedef struct
+    {
+        std::string_view Parent;
+        std::string_view Name;
+        DWORD Index;
+    } PendingFile;
+
+    std::vector<PendingFile> pending;
+    pending.reserve(files.size());
+    for (DWORD i = 0; i < files.size(); i++)
+    {
+        std::string_view path = files[i].Destination;
+        size_t lastSlash = path.find_last_of('/');
+        if (path.empty() || path[0] != '/' || lastSlash == path.length() - 1)
+            return false;
+        pending.push_back({ lastSlash ? path.substr(1, lastSlash - 1) : std::string_view(), path.substr(lastSlash + 1), i });
+    }
+
+    // Group by parent. Inside a directory priority files come first, the rest keep their listed order
+    std::stable_sort(pending.begin(), pending.end(), [&files](PendingFile const& a, PendingFile const& b)
+    {
+        if (a.Parent != b.Parent)
+            return a.Parent < b.Parent;
+        auto const &aPriority = files[a.Index].Priority;
+        auto const &bPriority = files[b.Index].Priority;
+        if (aPriority.has_value() != bPriority.has_value())
+            return aPriority.has_value();
+        return aPriority.value_or(0) < bPriority.value_or(0);
+    });
+
+    // Only reproducible builds without a fixed timestamp take the time of every source
+    bool perFileTimestamps = reproducible && !fixedTimestamp.has_value();
+
+    std::vector<DWORD> entryEnds;
+    std::vector<DWORD> clusters;
+    for (size_t groupStart = 0; groupStart < pending.size();)
+    {
+        size_t groupEnd = groupStart + 1;
+        while (groupEnd < pending.size() && pending[groupEnd].Parent == pending[groupStart].Parent)
+            groupEnd++;
+
+        auto start = std::chrono::steady_clock::now();
+        pathStatistics.lookups++;
+        DWORD parent = findDirectory(pending[groupStart].Parent);
+        pathStatistics.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        if (parent == UINT32_MAX)
+            return false;
+
+        auto dateTime = getCurrentDateAndTime();
+        std::vector<std::pair<std::unique_ptr<BYTE[]>, DWORD>> entries;
+        std::vector<FatFilePlacement> placements;
+        entries.reserve(groupEnd - groupStart);
+        placements.reserve(groupEnd - groupStart);
+        entryEnds.clear();
+        DWORD groupBufferSize = 0;
+        std::string shortName;
+        bool isLongName;
+        BYTE caseFlags;
+        for (size_t i = groupStart; i < groupEnd; i++)
+        {
+            if (!getUniqueShortName(directories[parent].names, pending[i].Name, shortName, isLongName, caseFlags))
+                return false;
+
+            std::string sourcePath(files[pending[i].Index].Source);
+            auto reservation = reservedFileClusters.find(std::string(files[pending[i].Index].Destination));
+            auto const *fileReservation = reservation != reservedFileClusters.end() ? &reservation->second : nullptr;
+            auto const &file = files[pending[i].Index];
+            if (sourcePath.empty() && file.Size.value_or(QWORD(UINT32_MAX) + 1) > UINT32_MAX)
+                return false;
+            auto loadedFile = sourcePath.empty() ? preallocateFile(static_cast<DWORD>(file.Size.value()), file.Fill, fileReservation) :
+                writeFile(sourcePath, fileReservation);
+            if (loadedFile.first == UINT32_MAX)
+                return false;
+
+            DWORD entryBufferSize;
+            auto entryBuffer = getDirectoryEntry(pending[i].Name, shortName, isLongName, caseFlags, false, loadedFile.first, loadedFile.second,
+                perFileTimestamps ? getFileDateAndTime(sourcePath) : dateTime, entryBufferSize);
+            if (!entryBuffer.get())
+                return false;
+
+            groupBufferSize += entryBufferSize;
+            entryEnds.push_back(groupBufferSize / sizeof(DIR_ENTRY));
+            entries.emplace_back(std::move(entryBuffer), entryBufferSize);
+            placements.push_back({ loadedFile.first, loadedFile.second, 0 });
+        }
+
+        // Emit the entries of the whole group with a single pass over the directory chain
+        auto groupBuffer = std::unique_ptr<BYTE[]>(new BYTE[groupBufferSize]);
+        DWORD offset = 0;
+        for (auto const &entry : entries)
+        {
+            std::memcpy(groupBuffer.get() + offset, entry.first.get(), entry.second);
+            offset += entry.second;
+        }
+
+        FatRawDirectory &directory = directories[parent].rawDirectory;
+        DWORD firstEntryIndex = directory.entryIndex;
+        clusters.clear();
+        if (!writeDirectoryEntries(directory, groupBuffer, groupBufferSize, &clusters))
+            return false;
+
+        // The short entry is the last one of every file
+        for (size_t i = groupStart; i < groupEnd; i++)
+        {
+            DWORD position = firstEntryIndex + entryEnds[i - groupStart] - 1;
+            DIR_ENTRY *entry = &((reinterpret_cast<DIR_ENTRY*>(getPointerToCluster(clusters[position / maxDirEntries])))[position % maxDirEntries]);
+            FatFilePlacement &placement = placements[i - groupStart];
+            placement.EntryOffset = reinterpret_cast<BYTE*>(entry) - partitionStart;
+            filePlacements[std::string(files[pending[i].Index].Destination)] = placement;
+        }
+
+        groupStart = groupEnd;
+    }
+
+    return true;
+}
+
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::printStatistics()
+{
+    // Approximate footprint of the directory tree, hash nodes hold a key, a value and a next pointer
+    QWORD treeBytes = directories.capacity() * sizeof(FatDirectory) +
+        directoryChildren.bucket_count() * sizeof(void*) + directoryChildren.size() * (sizeof(QWORD) + sizeof(DWORD) + sizeof(void*)) +
+        internedNames.bucket_count() * sizeof(void*) + internedNames.size() * (sizeof(std::string_view) + sizeof(DWORD) + sizeof(void*)) +
+        nameBlocks.size() * FAT_NAME_BLOCK_SIZE;
+
+    std::cout << "directory tree: " << directories.size() << " directories, " << internedNames.size() << " interned names ("
+        << nameBytes << " bytes), ~" << treeBytes << " bytes" << std::endl;
+    QWORD directoryClusters = 0, directoryFragments = 0;
+    for (auto const &directory : directories)
+    {
+        DIR_ENTRY const *self = directory.rawDirectory.self;
+        getChainFragmentation(self ? (static_cast<DWORD>(self->DIR_FstClusHI) << 16 | self->DIR_FstClusLO) : 2, directoryClusters, directoryFragments);
+    }
+
+    QWORD fileClusters = 0, fileFragments = 0, fragmentedFiles = 0;
+    for (auto const &[path, placement] : filePlacements)
+    {
+        QWORD fragments = 0;
+        getChainFragmentation(placement.FirstCluster, fileClusters, fragments);
+        fileFragments += fragments;
+        fragmentedFiles += fragments > 1;
+    }
+
+    std::cout << "directory chains: " << directoryClusters << " clusters in " << directoryFragments << " fragments, file chains: "
+        << fileClusters << " clusters in " << fileFragments << " fragments (" << fragmentedFiles << " fragmented files)" << std::endl;
+    std::cout << "path lookups: " << pathStatistics.lookups << ", " << pathStatistics.cacheHits << " parent cache hits, "
+        << pathStatistics.components << " components walked";
+    if (pathStatistics.lookups)
+        std::cout << ", " << pathStatistics.nanoseconds / pathStatistics.lookups << " ns per lookup";
+    std::cout << std::endl;
+}
+
+template <DWORD SectorSize>
+std::optional<FatFilePlacement> BasicFat<SectorSize>::getFilePlacement(std::string const& destinationPath)
+{
+    auto it = filePlacements.find(destinationPath);
+    if (it == filePlacements.end())
+        return {};
+    return it->second;
+}
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::replaceFile(FatFilePlacement &placement, std::string const& sourcePath)
+{
+    std::ifstream in(sourcePath, std::ios::in | std::ios::ate | std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    QWORD qFileSize = in.tellg();
+    in.seekg(0);
+    if (qFileSize >= UINT32_MAX)
+        return false;
+
+    // Clusters of this image are about to move, cached placements can't be trusted anymore
+    std::string cacheKey;
+    std::optional<SourceCacheEntry> cached;
+    if (sourceCache)
+    {
+        sourceCache->invalidateImage(destination);
+        cached = sourceCache->find(sourcePath, cacheKey);
+    }
+
+    // Reuse the clusters already owned by the file, only the difference is allocated or released
+    DWORD fileSize = static_cast<DWORD>(qFileSize);
+    DWORD clusterCount = fileSize / clusterSize + (fileSize % clusterSize ? 1 : 0);
+    DWORD firstCluster = resizeClusterChain(placement.FirstCluster, clusterCount);
+    if (firstCluster == UINT32_MAX)
         return false;
 
-    return createRawFile(pDir->rawDirectory, name, sourcePath);
+    bool contiguous = clusterCount && isContiguousChain(firstCluster, clusterCount);
+    if (contiguous && cached.has_value() && cached->Size == fileSize && copyCachedSource(cached.value(), getPointerToCluster(firstCluster)))
+        sourceCache->recordHit(cacheKey, cached.value(), getPointerToCluster(firstCluster));
+    else if (clusterCount)
+    {
+        writeFileData(in, firstCluster, fileSize);
+        if (sourceCache && contiguous && !cached.has_value())
+        {
+            BYTE *data = getPointerToCluster(firstCluster);
+            sourceCache->insert(cacheKey, fileSize, data, destination, data - imageStart);
+        }
+    }
+    in.close();
+
+    auto dateTime = getFileDateAndTime(sourcePath);
+    DIR_ENTRY *entry = reinterpret_cast<DIR_ENTRY*>(partitionStart + placement.EntryOffset);
+    entry->DIR_FstClusHI = firstCluster >> 16;
+    entry->DIR_FstClusLO = firstCluster & UINT16_MAX;
+    entry->DIR_FileSize = fileSize;
+    entry->DIR_LstAccDate = dateTime.first;
+    entry->DIR_WrtTime = dateTime.second;
+    entry->DIR_WrtDate = dateTime.first;
+    if (reproducible)
+    {
+        // A clean build would have created the entry with the same timestamp
+        entry->DIR_CrtTime = dateTime.second;
+        entry->DIR_CrtDate = dateTime.first;
+    }
+
+    placement.FirstCluster = firstCluster;
+    placement.Size = fileSize;
+    return true;
+}
+
+template <DWORD SectorSize>
+void BasicFat<SectorSize>::touchFile(FatFilePlacement const& placement, std::string const& sourcePath)
+{
+    // Only entries stamped with the time of their source follow it, as a clean build would
+    if (!reproducible || fixedTimestamp.has_value())
+        return;
+
+    auto dateTime = getFileDateAndTime(sourcePath);
+    DIR_ENTRY *entry = reinterpret_cast<DIR_ENTRY*>(partitionStart + placement.EntryOffset);
+    entry->DIR_CrtTime = dateTime.second;
+    entry->DIR_CrtDate = dateTime.first;
+    entry->DIR_LstAccDate = dateTime.first;
+    entry->DIR_WrtTime = dateTime.second;
+    entry->DIR_WrtDate = dateTime.first;
 }
+
+template <DWORD SectorSize>
+bool BasicFat<SectorSize>::updateFile(std::string const& destinationPath, std::string const& sourcePath)
+{
+    auto it = filePlacements.find(destinationPath);
+    if (it == filePlacements.end())
+        return false;
+    return replaceFile(it->second, sourcePath);
+}
+
+template class BasicFat<SECTOR_SIZE_512>;
+template class BasicFat<SECTOR_SIZE_4K>;
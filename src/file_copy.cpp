@@ -0,0 +1,254 @@
+#include <file_copy.hpp>
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define COPY_BUFFER_SIZE (1 << 20)
+
+bool cloneFile(std::string const& source, std::string const& destination)
+{
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+        return false;
+
+    // Never write through an existing destination, it may be a hard link.
+    // Anything which isn't a regular file (a device) can't be cloned at all
+    struct stat sb;
+    if (lstat(destination.c_str(), &sb) == 0)
+    {
+        if (!S_ISREG(sb.st_mode))
+        {
+            close(in);
+            return false;
+        }
+        unlink(destination.c_str());
+    }
+
+    int out = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out == -1)
+    {
+        close(in);
+        return false;
+    }
+
+    // Shares the extents, only works when both files live on the same reflink capable filesystem
+    bool ret = ioctl(out, FICLONE, in) == 0;
+
+    close(out);
+    close(in);
+    if (!ret)
+        unlink(destination.c_str());
+    return ret;
+}
+
+static bool copyRange(int in, off_t inOffset, int out, off_t outOffset, off_t length)
+{
+    // copy_file_range stays inside the kernel and may even share extents
+    while (length > 0)
+    {
+        ssize_t copied = copy_file_range(in, &inOffset, out, &outOffset, length, 0);
+        if (copied <= 0)
+            break;
+        length -= copied;
+    }
+    if (!length)
+        return true;
+
+    auto buffer = std::unique_ptr<char[]>(new char[COPY_BUFFER_SIZE]);
+    while (length > 0)
+    {
+        ssize_t count = pread(in, buffer.get(), std::min<off_t>(length, COPY_BUFFER_SIZE), inOffset);
+        if (count <= 0)
+            return false;
+        if (pwrite(out, buffer.get(), count, outOffset) != count)
+            return false;
+        inOffset += count;
+        outOffset += count;
+        length -= count;
+    }
+    return true;
+}
+
+static bool zeroRange(int out, off_t offset, off_t length)
+{
+    // A device keeps whatever it held before, so holes have to be zeroed explicitly
+    uint64_t range[2] = {static_cast<uint64_t>(offset), static_cast<uint64_t>(length)};
+    if (!(offset % 512) && !(length % 512) && ioctl(out, BLKZEROOUT, range) == 0)
+        return true;
+
+    auto buffer = std::unique_ptr<char[]>(new char[COPY_BUFFER_SIZE]());
+    while (length > 0)
+    {
+        ssize_t count = pwrite(out, buffer.get(), std::min<off_t>(length, COPY_BUFFER_SIZE), offset);
+        if (count <= 0)
+            return false;
+        offset += count;
+        length -= count;
+    }
+    return true;
+}
+
+bool copyFile(std::string const& source, std::string const& destination)
+{
+    struct stat db;
+    bool device = stat(destination.c_str(), &db) == 0 && S_ISBLK(db.st_mode);
+    if (!device && cloneFile(source, destination))
+        return true;
+
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+        return false;
+
+    struct stat sb;
+    int out = device ? open(destination.c_str(), O_WRONLY | O_CLOEXEC) :
+        open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out == -1 || fstat(in, &sb) == -1 || (!device && ftruncate(out, sb.st_size) == -1))
+    {
+        if (out != -1)
+            close(out);
+        close(in);
+        return false;
+    }
+
+    // Images are mostly holes, only the data regions are copied
+    bool ret = true;
+    off_t offset = 0;
+    while (ret && offset < sb.st_size)
+    {
+        off_t dataStart = lseek(in, offset, SEEK_DATA);
+        if (dataStart == -1)
+        {
+            // ENXIO means only a hole is left, anything else means no hole support
+            if (errno != ENXIO)
+                ret = copyRange(in, offset, out, offset, sb.st_size - offset);
+            else if (device)
+                ret = zeroRange(out, offset, sb.st_size - offset);
+            break;
+        }
+        if (device && dataStart > offset)
+            ret = zeroRange(out, offset, dataStart - offset);
+
+        off_t dataEnd = lseek(in, dataStart, SEEK_HOLE);
+        if (dataEnd == -1)
+            dataEnd = sb.st_size;
+        ret = ret && copyRange(in, dataStart, out, dataStart, dataEnd - dataStart);
+        offset = dataEnd;
+    }
+
+    if (device && ret)
+        ret = fsync(out) == 0;
+
+    close(out);
+    close(in);
+    return ret;
+}
+
+bool placeFile(std::string const& source, std::string const& destination, QWORD offset)
+{
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+        return false;
+
+    struct stat sb;
+    struct stat db;
+    int out = open(destination.c_str(), O_WRONLY | O_CLOEXEC);
+    if (out == -1 || fstat(in, &sb) == -1 || fstat(out, &db) == -1)
+    {
+        if (out != -1)
+            close(out);
+        close(in);
+        return false;
+    }
+
+    // The whole blocks are shared with the source when both files live on the same reflink capable
+    // filesystem and the offset is on a block boundary of it, the rest is copied. The destination
+    // is a fresh sparse image, so holes of the source are skipped
+    off_t cloned = 0;
+    if (db.st_blksize > 0 && !(offset % db.st_blksize))
+    {
+        struct file_clone_range range = {};
+        range.src_fd = in;
+        range.src_length = sb.st_size - sb.st_size % db.st_blksize;
+        range.dest_offset = offset;
+        if (range.src_length && ioctl(out, FICLONERANGE, &range) == 0)
+            cloned = range.src_length;
+    }
+
+    bool ret = true;
+    off_t position = cloned;
+    while (ret && position < sb.st_size)
+    {
+        off_t dataStart = lseek(in, position, SEEK_DATA);
+        if (dataStart == -1)
+        {
+            if (errno != ENXIO)
+                ret = copyRange(in, position, out, offset + position, sb.st_size - position);
+            break;
+        }
+
+        off_t dataEnd = lseek(in, dataStart, SEEK_HOLE);
+        if (dataEnd == -1)
+            dataEnd = sb.st_size;
+        ret = copyRange(in, dataStart, out, offset + dataStart, dataEnd - dataStart);
+        position = dataEnd;
+    }
+
+    close(out);
+    close(in);
+    return ret;
+}
+
+QWORD getAllocatedSize(std::string const& path)
+{
+    struct stat sb;
+    if (stat(path.c_str(), &sb) == -1)
+        return 0;
+    return static_cast<QWORD>(sb.st_blocks) * 512;
+}
+
+#else
+
+#include <filesystem>
+#include <fstream>
+
+bool cloneFile(std::string const& source, std::string const& destination)
+{
+    return false;
+}
+
+bool copyFile(std::string const& source, std::string const& destination)
+{
+    std::error_code error;
+    return std::filesystem::copy_file(source, destination, std::filesystem::copy_options::overwrite_existing, error);
+}
+
+bool placeFile(std::string const& source, std::string const& destination, QWORD offset)
+{
+    std::ifstream in(source, std::ios::in | std::ios::binary);
+    std::fstream out(destination, std::ios::in | std::ios::out | std::ios::binary);
+    if (!in.is_open() || !out.is_open())
+        return false;
+
+    out.seekp(offset);
+    if (in.peek() != std::ifstream::traits_type::eof())
+        out << in.rdbuf();
+    return out.good();
+}
+
+QWORD getAllocatedSize(std::string const& path)
+{
+    std::error_code error;
+    QWORD size = std::filesystem::file_size(path, error);
+    return error ? 0 : size;
+}
+
+#endif
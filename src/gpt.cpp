@@ -1,16 +1,56 @@
 #include <gpt.hpp>
 
+#include <algorithm>
 #include <cstring>
+#include <vector>
 
 #include <crc32.hpp>
 #include <guid.hpp>
+#include <hash.hpp>
+#include <utf8.h>
 
-GptDisk::GptDisk(std::string const& outputPath) : os(outputPath, std::ios::out | std::ios::in | std::ios::binary) {}
+template <DWORD SectorSize>
+BasicGptDisk<SectorSize>::BasicGptDisk(std::string const& outputPath) : os(outputPath, std::ios::out | std::ios::in | std::ios::binary), diskConfigured(false), alignmentLBAs(DEFAULT_PARTITION_ALIGNMENT / SectorSize) {}
 
-EFI_GUID GptDisk::generateUuid()
+template <DWORD SectorSize>
+void BasicGptDisk<SectorSize>::setSeed(std::string const& seed)
 {
-    xg::Guid guid = xg::newGuid();
-    std::array<UINT8, 16> byteArray = guid.bytes();
+    uuidSeed = seed;
+}
+
+template <DWORD SectorSize>
+void BasicGptDisk<SectorSize>::setAlignment(QWORD alignment)
+{
+    alignmentLBAs = std::max<QWORD>(alignment / SectorSize, 1);
+}
+
+static EFI_LBA alignLba(EFI_LBA lba, QWORD alignment)
+{
+    return (lba + alignment - 1) / alignment * alignment;
+}
+
+template <DWORD SectorSize>
+EFI_GUID BasicGptDisk<SectorSize>::generateUuid(std::string const& name)
+{
+    std::array<UINT8, 16> byteArray;
+    if (uuidSeed.has_value())
+    {
+        // Reproducible builds derive every GUID from the seed and the name of its owner
+        std::string input = uuidSeed.value() + '\0' + name;
+        QWORD low = computeHash64(reinterpret_cast<BYTE const*>(input.data()), input.size(), 0);
+        QWORD high = computeHash64(reinterpret_cast<BYTE const*>(input.data()), input.size(), 1);
+        std::memcpy(byteArray.data(), &low, sizeof(QWORD));
+        std::memcpy(byteArray.data() + sizeof(QWORD), &high, sizeof(QWORD));
+
+        // Mark it as a version 8 (custom) RFC 4122 UUID
+        byteArray[6] = (byteArray[6] & 0x0F) | 0x80;
+        byteArray[8] = (byteArray[8] & 0x3F) | 0x80;
+    }
+    else
+    {
+        xg::Guid guid = xg::newGuid();
+        byteArray = guid.bytes();
+    }
 
     EFI_GUID uuid;
     uuid.Data1 = (byteArray[0] << 24) | (byteArray[1] << 16) | (byteArray[2] << 8) | byteArray[3];
@@ -28,7 +68,8 @@ EFI_GUID GptDisk::generateUuid()
     return uuid;
 }
 
-void GptDisk::configureDisk(std::vector<ConfigurationParitition> const& config)
+template <DWORD SectorSize>
+void BasicGptDisk<SectorSize>::configureDisk(std::vector<ConfigurationParitition> const& config)
 {
     // Our GPT Disk Layout
     // LBA 0: Protective MBR
@@ -36,26 +77,26 @@ void GptDisk::configureDisk(std::vector<ConfigurationParitition> const& config)
     // LBA 2: Primary Partition Table
     // LBA 3: Padding
     // LBA 4: FirstUsable
-    // LBA FirstStart
+    // LBA FirstStart, the first multiple of the alignment at or after FirstUsable
     // ...
     // LBA FirstLast
-    // LBA Padding 1 LBA
+    // LBA Padding 1 LBA, then up to the next multiple of the alignment
     // LBA Padding 1 LBA
     // LBA Secondary Paritition Table
     // ...
     // LBA Secondary GPT Header
 
     // Generate GPT Disk ID
-    diskId = generateUuid();
+    diskId = generateUuid("disk");
 
     // Set the sizes
-    gptHeaderSize = SECTOR_SIZE;
+    gptHeaderSize = SectorSize;
     partitionEntrySize = 2 * EFI_GPT_PART_ENTRY_MIN_SIZE;
 
     // Compute Header LBAs
     primaryHeader = 1;
     partitionTable = 2;
-    firstUsable = partitionTable + (partitionEntrySize * config.size()) / 512 + 1;
+    firstUsable = partitionTable + (partitionEntrySize * config.size()) / SectorSize + 1;
 
     // Compute all LBAs
     GptPartition gptPartition;
@@ -63,9 +104,10 @@ void GptDisk::configureDisk(std::vector<ConfigurationParitition> const& config)
     for (auto const& part : config)
     {
         gptPartition.Type = part.Type;
-        gptPartition.PartitionId = generateUuid();
-        gptPartition.LBACount = part.LBACount;
-        gptPartition.StartingLBA = currentLba;
+        gptPartition.PartitionId = generateUuid("partition/" + utf8::utf16to8(part.PartitionName));
+        gptPartition.LBACount = part.Size / SectorSize;
+        gptPartition.StartingLBA = alignLba(currentLba, alignmentLBAs);
+        currentLba = gptPartition.StartingLBA;
         currentLba += gptPartition.LBACount - 1;
         gptPartition.EndingLBA = currentLba;
         gptPartition.PartitionName = part.PartitionName;
@@ -75,17 +117,96 @@ void GptDisk::configureDisk(std::vector<ConfigurationParitition> const& config)
         gptPartitions.push_back(gptPartition);
     }
 
-    lastUsable = currentLba;
+    setLastUsable(currentLba);
+    diskConfigured = true;
+
+    os.seekp(0);
+}
+
+template <DWORD SectorSize>
+void BasicGptDisk<SectorSize>::setLastUsable(EFI_LBA lba)
+{
+    // The backup table and header follow the last usable LBA and end the disk
+    lastUsable = lba;
     backupPartitionTable = lastUsable + 1;
-    secondaryHeader = backupPartitionTable + (partitionEntrySize * config.size()) / 512;
+    secondaryHeader = backupPartitionTable + (partitionEntrySize * gptPartitions.size()) / SectorSize;
     last = secondaryHeader + 2; 
 
-    diskSize = (last - 1) * SECTOR_SIZE;
+    diskSize = (last - 1) * SectorSize;
+}
 
+template <DWORD SectorSize>
+bool BasicGptDisk<SectorSize>::loadDisk()
+{
+    // Reads back a disk written by createDisk, the primary header and table are trusted if their CRCs match
+    std::vector<BYTE> headerBuffer(SectorSize);
+    os.seekg(SectorSize);
+    os.read(reinterpret_cast<char*>(headerBuffer.data()), SectorSize);
+    EFI_PARTITION_TABLE_HEADER header;
+    std::memcpy(&header, headerBuffer.data(), sizeof(EFI_PARTITION_TABLE_HEADER));
+    if (!os || header.Header.Signature != EFI_PTAB_HEADER_ID || header.Header.HeaderSize != SectorSize ||
+        header.SizeOfPartitionEntry < sizeof(EFI_PARTITION_ENTRY) || header.MyLBA != 1)
+        return false;
+
+    EFI_PARTITION_TABLE_HEADER *bufferHeader = reinterpret_cast<EFI_PARTITION_TABLE_HEADER*>(headerBuffer.data());
+    bufferHeader->Header.CRC32 = 0;
+    if (computeCrc32(headerBuffer.data(), SectorSize) != header.Header.CRC32)
+        return false;
+
+    std::vector<BYTE> table(static_cast<QWORD>(header.NumberOfPartitionEntries) * header.SizeOfPartitionEntry);
+    os.seekg(header.PartitionEntryLBA * SectorSize);
+    os.read(reinterpret_cast<char*>(table.data()), table.size());
+    if (!os || computeCrc32(table.data(), table.size()) != header.PartitionEntryArrayCRC32)
+        return false;
+
+    gptPartitions.clear();
+    for (QWORD offset = 0; offset < table.size(); offset += header.SizeOfPartitionEntry)
+    {
+        EFI_PARTITION_ENTRY entry;
+        std::memcpy(&entry, table.data() + offset, sizeof(EFI_PARTITION_ENTRY));
+
+        GptPartition gptPartition;
+        gptPartition.Type = entry.PartitionTypeGUID;
+        gptPartition.PartitionId = entry.UniquePartitionGUID;
+        gptPartition.StartingLBA = entry.StartingLBA;
+        gptPartition.EndingLBA = entry.EndingLBA;
+        gptPartition.LBACount = entry.EndingLBA - entry.StartingLBA + 1;
+        std::u16string name(reinterpret_cast<char16_t const*>(entry.PartitionName), 36);
+        gptPartition.PartitionName = name.substr(0, name.find(u'\0'));
+        gptPartitions.push_back(gptPartition);
+    }
+
+    diskId = header.DiskGUID;
+    gptHeaderSize = header.Header.HeaderSize;
+    partitionEntrySize = header.SizeOfPartitionEntry;
+    primaryHeader = header.MyLBA;
+    partitionTable = header.PartitionEntryLBA;
+    firstUsable = header.FirstUsableLBA;
+    setLastUsable(header.LastUsableLBA);
+    diskConfigured = true;
+
+    return true;
+}
+
+template <DWORD SectorSize>
+bool BasicGptDisk<SectorSize>::resizeLastPartition(QWORD lbaCount)
+{
+    // Moves the backup table and header right after the new end, createDisk writes the result
+    if (gptPartitions.empty() || !lbaCount)
+        return false;
+
+    GptPartition &lastPartition = gptPartitions.back();
+    lastPartition.LBACount = lbaCount;
+    lastPartition.EndingLBA = lastPartition.StartingLBA + lbaCount - 1;
+    setLastUsable(lastPartition.EndingLBA + 2);
+
+    os.clear();
     os.seekp(0);
+    return true;
 }
 
-std::unique_ptr<MASTER_BOOT_RECORD> GptDisk::getGptProtectiveMbr()
+template <DWORD SectorSize>
+std::unique_ptr<MASTER_BOOT_RECORD> BasicGptDisk<SectorSize>::getGptProtectiveMbr()
 {
     auto ret = std::make_unique<MASTER_BOOT_RECORD>();
     
@@ -104,7 +225,8 @@ std::unique_ptr<MASTER_BOOT_RECORD> GptDisk::getGptProtectiveMbr()
     return ret;
 }
 
-std::unique_ptr<EFI_PARTITION_ENTRY> GptDisk::getEfiPartitionEntry(GptPartition const& partition)
+template <DWORD SectorSize>
+std::unique_ptr<EFI_PARTITION_ENTRY> BasicGptDisk<SectorSize>::getEfiPartitionEntry(GptPartition const& partition)
 {
     auto ret = std::make_unique<EFI_PARTITION_ENTRY>();
 
@@ -120,7 +242,8 @@ std::unique_ptr<EFI_PARTITION_ENTRY> GptDisk::getEfiPartitionEntry(GptPartition
     return ret;
 }
 
-BYTE* GptDisk::generatePartitionTable()
+template <DWORD SectorSize>
+BYTE* BasicGptDisk<SectorSize>::generatePartitionTable()
 {
     QWORD bufferLength = partitionEntrySize * gptPartitions.size();
     BYTE *ret = new BYTE[bufferLength];
@@ -138,7 +261,8 @@ BYTE* GptDisk::generatePartitionTable()
     return ret;
 }
 
-std::unique_ptr<EFI_PARTITION_TABLE_HEADER> GptDisk::getInitialEfiPartitionTableHeader()
+template <DWORD SectorSize>
+std::unique_ptr<EFI_PARTITION_TABLE_HEADER> BasicGptDisk<SectorSize>::getInitialEfiPartitionTableHeader()
 {
     auto ret = std::make_unique<EFI_PARTITION_TABLE_HEADER>();
 
@@ -157,7 +281,8 @@ std::unique_ptr<EFI_PARTITION_TABLE_HEADER> GptDisk::getInitialEfiPartitionTable
     return ret;
 }
 
-void GptDisk::createDisk()
+template <DWORD SectorSize>
+void BasicGptDisk<SectorSize>::createDisk()
 {
     // Write the Protective MBR
     auto mbr = getGptProtectiveMbr();
@@ -170,46 +295,53 @@ void GptDisk::createDisk()
     // Compute partition table CRC32
     DWORD partitionCrc32 = computeCrc32(gptPartitionTable, gptPartitionTableLength);
 
-    UINT8 *headerBuffer = new UINT8[SECTOR_SIZE];
-    std::memset(headerBuffer, 0, SECTOR_SIZE);
+    UINT8 *headerBuffer = new UINT8[SectorSize];
+    std::memset(headerBuffer, 0, SectorSize);
 
     auto gptHeader = getInitialEfiPartitionTableHeader();
     gptHeader->PartitionEntryArrayCRC32 = partitionCrc32;
     std::memcpy(headerBuffer, gptHeader.get(), sizeof(EFI_PARTITION_TABLE_HEADER));
 
     // Compute GPT Header CRC32
-    DWORD gptHeaderCrc32 = computeCrc32(headerBuffer, SECTOR_SIZE);
+    DWORD gptHeaderCrc32 = computeCrc32(headerBuffer, SectorSize);
     gptHeader->Header.CRC32 = gptHeaderCrc32;
 
-    // Write Primary GPT Header
+    // Write Primary GPT Header, the protective MBR only fills the first 512 bytes of LBA 0
+    os.seekp(primaryHeader * SectorSize);
     os.write(reinterpret_cast<const char*>(gptHeader.get()), sizeof(EFI_PARTITION_TABLE_HEADER));
-    os.seekp(partitionTable * SECTOR_SIZE);
+    os.seekp(partitionTable * SectorSize);
 
     // Write Primary Partition Table
     os.write(reinterpret_cast<const char*>(gptPartitionTable), gptPartitionTableLength);
 
     // Jump to and write Secondary Partition Table
-    os.seekp(backupPartitionTable * SECTOR_SIZE);
+    os.seekp(backupPartitionTable * SectorSize);
     os.write(reinterpret_cast<const char*>(gptPartitionTable), gptPartitionTableLength);
 
-    // Prepare Secondary GPT Header
+    // Prepare Secondary GPT Header, it describes the backup table
     gptHeader->MyLBA = secondaryHeader;
     gptHeader->AlternateLBA = primaryHeader;
+    gptHeader->PartitionEntryLBA = backupPartitionTable;
     gptHeader->Header.CRC32 = 0;
     std::memcpy(headerBuffer, gptHeader.get(), sizeof(EFI_PARTITION_TABLE_HEADER));
-    gptHeaderCrc32 = computeCrc32(headerBuffer, SECTOR_SIZE);
-    os.write(reinterpret_cast<const char*>(gptHeader.get()), sizeof(EFI_PARTITION_TABLE_HEADER));
+    gptHeaderCrc32 = computeCrc32(headerBuffer, SectorSize);
+    gptHeader->Header.CRC32 = gptHeaderCrc32;
+    std::memcpy(headerBuffer, gptHeader.get(), sizeof(EFI_PARTITION_TABLE_HEADER));
+
+    // Written as a whole sector, so the image ends on a sector boundary
+    os.seekp(secondaryHeader * SectorSize);
+    os.write(reinterpret_cast<const char*>(headerBuffer), SectorSize);
 
     delete[] headerBuffer;
     delete[] gptPartitionTable;
 
-    diskCreated = true;
     os.close();
 }
 
-std::optional<GptPartition> GptDisk::getPartition(std::u16string const& partitionName)
+template <DWORD SectorSize>
+std::optional<GptPartition> BasicGptDisk<SectorSize>::getPartition(std::u16string const& partitionName)
 {
-    if (!diskCreated)
+    if (!diskConfigured)
         return {};
     
     for (auto const& part : gptPartitions)
@@ -221,9 +353,28 @@ std::optional<GptPartition> GptDisk::getPartition(std::u16string const& partitio
     return {};
 }
 
-std::optional<QWORD> GptDisk::getDiskSize()
+template <DWORD SectorSize>
+std::optional<GptPartition> BasicGptDisk<SectorSize>::getLastPartition()
+{
+    if (!diskConfigured || gptPartitions.empty())
+        return {};
+    return gptPartitions.back();
+}
+
+template <DWORD SectorSize>
+QWORD BasicGptDisk<SectorSize>::getMetadataSize()
 {
-    if (!diskCreated)
+    // Protective MBR, both headers and both partition tables
+    return 3 * SectorSize + 2 * static_cast<QWORD>(partitionEntrySize) * gptPartitions.size();
+}
+
+template <DWORD SectorSize>
+std::optional<QWORD> BasicGptDisk<SectorSize>::getDiskSize()
+{
+    if (!diskConfigured)
         return {};
     return diskSize;
 }
+
+template class BasicGptDisk<SECTOR_SIZE_512>;
+template class BasicGptDisk<SECTOR_SIZE_4K>;
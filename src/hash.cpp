@@ -0,0 +1,130 @@
+#include <hash.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+// XXH64 by Yann Collet, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+// Used to detect changed inputs, not for anything security related
+
+static constexpr QWORD Prime1 = 0x9E3779B185EBCA87ULL;
+static constexpr QWORD Prime2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr QWORD Prime3 = 0x165667B19E3779F9ULL;
+static constexpr QWORD Prime4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr QWORD Prime5 = 0x27D4EB2F165667C5ULL;
+
+// Files are hashed in chunks, every chunk hash seeds the next one
+#define HASH_FILE_CHUNK_SIZE (1 << 20)
+
+static inline QWORD rotateLeft(QWORD value, int count)
+{
+    return (value << count) | (value >> (64 - count));
+}
+
+static inline QWORD read64(BYTE const *ptr)
+{
+    QWORD value;
+    std::memcpy(&value, ptr, sizeof(QWORD));
+    return value;
+}
+
+static inline DWORD read32(BYTE const *ptr)
+{
+    DWORD value;
+    std::memcpy(&value, ptr, sizeof(DWORD));
+    return value;
+}
+
+static inline QWORD round(QWORD accumulator, QWORD input)
+{
+    accumulator += input * Prime2;
+    accumulator = rotateLeft(accumulator, 31);
+    return accumulator * Prime1;
+}
+
+static inline QWORD mergeRound(QWORD accumulator, QWORD value)
+{
+    accumulator ^= round(0, value);
+    return accumulator * Prime1 + Prime4;
+}
+
+QWORD computeHash64(BYTE const *Data, QWORD Length, QWORD Seed)
+{
+    BYTE const *ptr = Data;
+    BYTE const *end = Data + Length;
+    QWORD hash;
+
+    if (Length >= 32)
+    {
+        QWORD v1 = Seed + Prime1 + Prime2;
+        QWORD v2 = Seed + Prime2;
+        QWORD v3 = Seed;
+        QWORD v4 = Seed - Prime1;
+
+        BYTE const *limit = end - 32;
+        do
+        {
+            v1 = round(v1, read64(ptr));
+            v2 = round(v2, read64(ptr + 8));
+            v3 = round(v3, read64(ptr + 16));
+            v4 = round(v4, read64(ptr + 24));
+            ptr += 32;
+        } while (ptr <= limit);
+
+        hash = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+        hash = mergeRound(hash, v1);
+        hash = mergeRound(hash, v2);
+        hash = mergeRound(hash, v3);
+        hash = mergeRound(hash, v4);
+    }
+    else
+        hash = Seed + Prime5;
+
+    hash += Length;
+
+    while (ptr + 8 <= end)
+    {
+        hash ^= round(0, read64(ptr));
+        hash = rotateLeft(hash, 27) * Prime1 + Prime4;
+        ptr += 8;
+    }
+
+    if (ptr + 4 <= end)
+    {
+        hash ^= static_cast<QWORD>(read32(ptr)) * Prime1;
+        hash = rotateLeft(hash, 23) * Prime2 + Prime3;
+        ptr += 4;
+    }
+
+    while (ptr < end)
+    {
+        hash ^= (*ptr) * Prime5;
+        hash = rotateLeft(hash, 11) * Prime1;
+        ptr++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+bool computeFileHash64(std::string const& path, QWORD &hash)
+{
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    auto buffer = std::unique_ptr<BYTE[]>(new BYTE[HASH_FILE_CHUNK_SIZE]);
+    hash = 0;
+    do
+    {
+        in.read(reinterpret_cast<char*>(buffer.get()), HASH_FILE_CHUNK_SIZE);
+        hash = computeHash64(buffer.get(), in.gcount(), hash);
+    } while (in.gcount() == HASH_FILE_CHUNK_SIZE);
+
+    return !in.bad();
+}
@@ -1,78 +1,1260 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
 #include <optional>
+#include <filesystem>
+#include <memory>
+#include <numeric>
+#include <unordered_map>
+#include <unordered_set>
 
+#include <build_cache.hpp>
 #include <cal_types.h>
+#include <config.hpp>
 #include <gpt.hpp>
 #include <fat.hpp>
+#include <file_copy.hpp>
+#include <hash.hpp>
 #include <json.hpp>
+#include <manifest.hpp>
+#include <preflight.hpp>
+#include <source_cache.hpp>
+#include <tar_reader.hpp>
+#include <tree_walk.hpp>
 #include <utf8.h>
+#include <watch.hpp>
 
 using json = nlohmann::json;
 
-int main(int argc, char *argv[])
+#define DEFAULT_CACHE_SIZE_LIMIT (10ULL << 30)
+#define DEFAULT_SOURCE_CACHE_SIZE_LIMIT (64ULL << 20)
+#define DEFAULT_SOURCE_CACHE_DISK_LIMIT (10ULL << 30)
+
+// Build time model, measured with the sources in the page cache. --calibration scales it
+// by the ratio of measured to modelled time, averaged over the last few builds
+#define BUILD_MICROSECONDS_PER_FILE 15
+#define BUILD_BYTES_PER_SECOND (1000ULL << 20)
+#define CALIBRATION_BUILDS 8
+
+// FAT32 stores file sizes in 32 bits
+#define FAT_MAX_FILE_SIZE 0xFFFFFFFFULL
+
+typedef struct
 {
-    if (argc < 2)
-        return 1;
+    QWORD BytesWritten;
+    QWORD Files;
+} ImageEstimate;
+
+static std::vector<FatFileSpec> getFileSpecs(ConfigurationFilesystem const& configFilesystem, bool withArchives = false)
+{
+    // Archive members only take part in planning, their data comes from the archive stream
+    std::vector<FatFileSpec> files;
+    files.reserve(configFilesystem.Files.size());
+    for (auto const &configFile : configFilesystem.Files)
+        files.push_back({ configFile.Destination, configFile.Source, configFile.Priority, configFile.Size, configFile.Fill });
+    for (auto const &archive : configFilesystem.Archives)
+    {
+        if (!withArchives)
+            break;
+        for (auto const &configFile : archive.Files)
+            files.push_back({ configFile.Destination, configFile.Source, configFile.Priority, configFile.Size, configFile.Fill });
+    }
+    return files;
+}
+
+static std::vector<std::string> getDirectories(ConfigurationFilesystem const& configFilesystem)
+{
+    // Directories found in archives are created and laid out with the listed ones
+    std::vector<std::string> directories = configFilesystem.Directories;
+    for (auto const &archive : configFilesystem.Archives)
+        directories.insert(directories.end(), archive.Directories.begin(), archive.Directories.end());
+    return directories;
+}
+
+template <DWORD SectorSize>
+static int planPartitions(Configuration const& config, std::vector<ConfigurationParitition> &partitions, std::unordered_map<std::string, DWORD> &plannedClusterSizes, bool statistics)
+{
+    // Partitions sized "auto" get the smallest valid FAT32 geometry for their filesystem,
+    // which then uses the cluster size it was planned with
+    partitions = config.Partitions;
+    for (auto &partition : partitions)
+    {
+        if (!partition.Headroom.has_value())
+            continue;
+
+        // A content image takes whole sectors, headroom percent more
+        if (!partition.Content.empty())
+        {
+            std::error_code error;
+            QWORD contentSize = partition.ContentSize.has_value() ? partition.ContentSize.value() : std::filesystem::file_size(partition.Content, error);
+            if (error)
+                return 12;
+            contentSize += contentSize * partition.Headroom.value() / 100;
+            partition.Size = std::max<QWORD>(1, (contentSize + SectorSize - 1) / SectorSize) * SectorSize;
+            continue;
+        }
 
-    std::ifstream in(argv[1]);
-    json jsonConfig = json::parse(in);
-    in.close();   
+        std::string name = utf8::utf16to8(partition.PartitionName);
+        auto configFilesystem = std::find_if(config.Filesystems.begin(), config.Filesystems.end(),
+            [&name](ConfigurationFilesystem const &filesystem) { return filesystem.Partition == name; });
+        std::vector<std::string> directories = getDirectories(*configFilesystem);
+        std::vector<FatFileSpec> files = getFileSpecs(*configFilesystem, true);
+        DWORD clusterSize = configFilesystem->ClusterSize;
+        QWORD lbaCount;
+        if (!BasicFat<SectorSize>::planFilesystem(directories, files, partition.Headroom.value(), config.EraseBlockSize, clusterSize, lbaCount))
+            return 12;
+        partition.Size = lbaCount * SectorSize;
+        plannedClusterSizes[name] = clusterSize;
+        if (statistics)
+            std::cout << name << ": planned " << lbaCount << " sectors with " << clusterSize << " byte clusters" << std::endl;
+    }
+
+    return 0;
+}
+
+template <DWORD SectorSize>
+static bool selectClusterSize(BasicFat<SectorSize> &fat, ConfigurationFilesystem const& configFilesystem, std::span<std::string const> directories, std::span<FatFileSpec const> files, std::unordered_map<std::string, DWORD> const& plannedClusterSizes)
+{
+    auto plannedClusterSize = plannedClusterSizes.find(configFilesystem.Partition);
+    fat.setClusterSize(plannedClusterSize != plannedClusterSizes.end() ? plannedClusterSize->second : configFilesystem.ClusterSize);
+    if (configFilesystem.OptimizeClusterSize && plannedClusterSize == plannedClusterSizes.end())
+    {
+        std::cout << configFilesystem.Partition << ": ";
+        std::optional<DWORD> clusterSize = fat.optimizeClusterSize(directories, files);
+        if (!clusterSize.has_value())
+            return false;
+        fat.setClusterSize(clusterSize.value());
+    }
 
-    std::string outputImagePath = jsonConfig["output"];
+    return true;
+}
 
-    // Create the partition config
-    std::vector<ConfigurationParitition> partitionConfig;
-    partitionConfig.reserve(8);
-    for (auto const &jsonPartition : jsonConfig["partitions"])
+static void expandSourceDirectories(Configuration &config, std::vector<PreflightProblem> &problems, bool statistics)
+{
+    // Imported trees are appended to the listed directories and files in sorted order,
+    // so every parent is created first and files of the same directory follow each other
+    for (auto &configFilesystem : config.Filesystems)
     {
-        ConfigurationParitition partition;
+        for (auto const &sourceDirectory : configFilesystem.SourceDirectories)
+        {
+            auto start = std::chrono::steady_clock::now();
+            std::vector<TreeEntry> entries;
+            std::string error;
+            if (!walkTree(sourceDirectory.Source, sourceDirectory.Include, sourceDirectory.Exclude, entries, error))
+            {
+                problems.push_back({ configFilesystem.Partition, sourceDirectory.Source, "unreadable_source_dir", error });
+                continue;
+            }
+
+            std::string destination = sourceDirectory.Destination == "/" ? std::string() : sourceDirectory.Destination;
+            size_t directories = 0;
+            for (auto const &entry : entries)
+            {
+                if (entry.Directory)
+                {
+                    configFilesystem.Directories.push_back(destination + "/" + entry.Path);
+                    directories++;
+                }
+                else
+                {
+                    ConfigurationFile file;
+                    file.Source = sourceDirectory.Source + "/" + entry.Path;
+                    file.Destination = destination + "/" + entry.Path;
+                    configFilesystem.Files.push_back(std::move(file));
+                }
+            }
+
+            if (statistics)
+                std::cout << configFilesystem.Partition << ": " << sourceDirectory.Source << ": " << directories << " directories and "
+                    << entries.size() - directories << " files walked in " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+                    << " ms" << std::endl;
+        }
+    }
+}
+
+static std::string getUpperPath(std::string_view path)
+{
+    // Long names compare case insensitively
+    std::string upperPath(path);
+    for (auto &c : upperPath)
+        c = std::toupper(static_cast<unsigned char>(c));
+    return upperPath;
+}
 
-        if (jsonPartition["type"] == "EFI")
-            partition.Type = EFI_PART_TYPE_EFI_SYSTEM_PART_GUID;
-        else if (jsonPartition["type"] == "BDP")
-            partition.Type = EFI_PART_TYPE_MICROSOFT_BASIC_DATA_GUID;
-        else if (jsonPartition["type"] == "LINUX_SWAP")
-            partition.Type = EFI_PART_TYPE_LINUX_SWAP_GUID;
+template <DWORD SectorSize>
+static void preflight(Configuration &config, bool checkCapacity, std::vector<PreflightProblem> &problems)
+{
+    // Every input is checked before the output is touched and every problem is reported, not just the first.
+    // The sources are looked up concurrently, their sizes are kept for the layout
+    std::vector<PreflightSource> sources;
+    std::unordered_map<std::string_view, size_t> sourceIndices;
+    auto addSource = [&sources, &sourceIndices](std::string const& path)
+    {
+        if (sourceIndices.try_emplace(path, sources.size()).second)
+            sources.push_back({ path, 0, std::string(), false });
+    };
+    for (auto const &configFilesystem : config.Filesystems)
+    {
+        for (auto const &configFile : configFilesystem.Files)
+        {
+            if (!configFile.Source.empty())
+                addSource(configFile.Source);
+        }
+    }
+    for (auto const &variant : config.Variants)
+    {
+        for (auto const &variantFile : variant.Files)
+            addSource(variantFile.Source);
+    }
+    for (auto const &configPartition : config.Partitions)
+    {
+        if (!configPartition.Content.empty())
+            addSource(configPartition.Content);
+    }
+    statSources(sources);
+
+    auto checkSource = [&](std::string const& partition, std::string const& path) -> std::optional<QWORD>
+    {
+        PreflightSource const &source = sources[sourceIndices[path]];
+        if (!source.Error.empty())
+            problems.push_back({ partition, path, "missing_source", source.Error });
+        else if (!source.RegularFile)
+            problems.push_back({ partition, path, "not_a_file", "the source is not a regular file" });
+        else if (source.Size > FAT_MAX_FILE_SIZE)
+            problems.push_back({ partition, path, "file_too_large", std::to_string(source.Size) + " bytes, FAT32 files hold at most " + std::to_string(FAT_MAX_FILE_SIZE) });
         else
-            return 2;
-        
-        partition.LBACount = jsonPartition["size"].get<QWORD>() * 2;
-        partition.PartitionName = utf8::utf8to16(jsonPartition["name"].get<std::string>());
-        partitionConfig.push_back(partition);
+            return source.Size;
+        return std::nullopt;
+    };
+
+    // Content images must fit a partition of fixed size, auto sized ones are planned from them
+    for (auto &configPartition : config.Partitions)
+    {
+        if (configPartition.Content.empty())
+            continue;
+        std::string partition = utf8::utf16to8(configPartition.PartitionName);
+        configPartition.ContentSize = checkSource(partition, configPartition.Content);
+        if (configPartition.ContentSize.has_value() && !configPartition.Headroom.has_value() && configPartition.ContentSize.value() > configPartition.Size)
+            problems.push_back({ partition, configPartition.Content, "content_too_large", std::to_string(configPartition.ContentSize.value()) +
+                " bytes, the partition holds " + std::to_string(configPartition.Size) });
     }
 
-    std::ofstream f(outputImagePath);
+    std::unordered_map<std::string, std::unordered_set<std::string>> filesystemDestinations;
+    DWORD standardInputArchives = 0;
+    for (auto &configFilesystem : config.Filesystems)
+    {
+        std::string const &partition = configFilesystem.Partition;
+        if (std::none_of(config.Partitions.begin(), config.Partitions.end(),
+            [&partition](ConfigurationParitition const &configPartition) { return utf8::utf16to8(configPartition.PartitionName) == partition; }))
+            problems.push_back({ partition, std::string(), "missing_partition", "no partition has this name" });
+
+        // Directories are created in the order they are listed, after their parent
+        std::unordered_set<std::string> directories = { std::string() };
+        std::unordered_set<std::string> &destinations = filesystemDestinations[partition];
+        std::unordered_map<std::string, FatDirectoryNames> directoryNames;
+        auto checkDestination = [&](std::string const& path) -> bool
+        {
+            if (path.empty() || path[0] != '/' || path.back() == '/')
+            {
+                problems.push_back({ partition, path, "invalid_path", "paths start with / and don't end with one" });
+                return false;
+            }
+
+            bool valid = true;
+            for (size_t start = 1, end; start <= path.length(); start = end + 1)
+            {
+                end = std::min(path.find('/', start), path.length());
+                std::string_view name = std::string_view(path).substr(start, end - start);
+                if (!BasicFat<SectorSize>::isValidName(name))
+                {
+                    problems.push_back({ partition, path, "invalid_name", "\"" + std::string(name) + "\" is not a valid FAT long name" });
+                    valid = false;
+                }
+            }
+
+            std::string upperPath = getUpperPath(path);
+            if (!directories.contains(upperPath.substr(0, upperPath.find_last_of('/'))))
+            {
+                problems.push_back({ partition, path, "missing_parent", "the parent directory isn't listed before it" });
+                valid = false;
+            }
+            if (!destinations.insert(upperPath).second)
+            {
+                problems.push_back({ partition, path, "duplicate_destination", "another entry has the same name, ignoring case" });
+                return false;
+            }
+
+            // Short names are handed out as the builder does, a name spelled like the alias of an earlier entry would find that entry
+            std::string shortName;
+            bool isLongName;
+            BYTE caseFlags;
+            if (!BasicFat<SectorSize>::getUniqueShortName(directoryNames[upperPath.substr(0, upperPath.find_last_of('/'))],
+                std::string_view(path).substr(path.find_last_of('/') + 1), shortName, isLongName, caseFlags))
+            {
+                problems.push_back({ partition, path, "duplicate_destination", "another entry has this name as its short name" });
+                valid = false;
+            }
+            return valid;
+        };
+
+        for (auto const &directory : configFilesystem.Directories)
+        {
+            if (checkDestination(directory))
+                directories.insert(getUpperPath(directory));
+        }
+
+        // The builder creates the files of a directory with priority files first
+        std::vector<size_t> fileOrder(configFilesystem.Files.size());
+        std::iota(fileOrder.begin(), fileOrder.end(), 0);
+        std::stable_sort(fileOrder.begin(), fileOrder.end(), [&configFilesystem](size_t a, size_t b)
+        {
+            auto const &aPriority = configFilesystem.Files[a].Priority;
+            auto const &bPriority = configFilesystem.Files[b].Priority;
+            if (aPriority.has_value() != bPriority.has_value())
+                return aPriority.has_value();
+            return aPriority.value_or(0) < bPriority.value_or(0);
+        });
+        for (size_t index : fileOrder)
+        {
+            auto &configFile = configFilesystem.Files[index];
+            checkDestination(configFile.Destination);
+            if (!configFile.Source.empty())
+                configFile.Size = checkSource(partition, configFile.Source);
+            else if (configFile.Size.value() > FAT_MAX_FILE_SIZE)
+                problems.push_back({ partition, configFile.Destination, "file_too_large", std::to_string(configFile.Size.value()) + " bytes, FAT32 files hold at most " + std::to_string(FAT_MAX_FILE_SIZE) });
+        }
+
+        // Archive files are scanned for their members, which are checked like listed entries. Parents
+        // missing from the archive are added, as extracting them creates them
+        for (auto &archive : configFilesystem.Archives)
+        {
+            if (archive.Destination != "/" && !directories.contains(getUpperPath(archive.Destination)))
+                problems.push_back({ partition, archive.Destination, "missing_parent", "the destination of the archive isn't a listed directory" });
+
+            // The destination matches a listed directory ignoring case, members are extracted and planned
+            // below the spelling it was listed with
+            auto listedDestination = std::find_if(configFilesystem.Directories.begin(), configFilesystem.Directories.end(),
+                [&archive](std::string const &directory) { return FatNameEqual()(directory, archive.Destination); });
+            if (listedDestination != configFilesystem.Directories.end())
+                archive.Destination = *listedDestination;
+            if (archive.Source == "-")
+            {
+                if (standardInputArchives++)
+                    problems.push_back({ partition, archive.Source, "duplicate_stdin", "only one archive can be read from stdin" });
+                if (configFilesystem.OptimizeClusterSize || std::any_of(config.Partitions.begin(), config.Partitions.end(), [&partition](ConfigurationParitition const &configPartition)
+                    { return configPartition.Headroom.has_value() && utf8::utf16to8(configPartition.PartitionName) == partition; }))
+                    problems.push_back({ partition, archive.Source, "unplannable_archive", "an archive read from stdin can't be scanned, the partition and cluster sizes must be given" });
+                continue;
+            }
+
+            std::vector<TarMember> members;
+            std::string error;
+            if (!scanArchive(archive.Source, members, error))
+            {
+                problems.push_back({ partition, archive.Source, "unreadable_archive", error });
+                continue;
+            }
+
+            std::string destination = archive.Destination == "/" ? std::string() : archive.Destination;
+            archive.Directories.clear();
+            archive.Files.clear();
+            std::vector<ConfigurationFile> links;
+            std::unordered_map<std::string, TarMember> membersByPath;
+            for (auto const &member : members)
+                membersByPath[member.Path] = member;
+            for (auto const &member : members)
+            {
+                if (member.Path.empty())
+                    continue;
+
+                // Links become copies of the regular file they lead to, anything else has no FAT equivalent
+                TarMember const *target = &member;
+                if (member.HardLink || member.SymbolicLink)
+                {
+                    target = resolveLink(membersByPath, member);
+                    if (!target)
+                    {
+                        problems.push_back({ partition, destination + "/" + member.Path, "unsupported_member", std::string(member.HardLink ? "hard" : "symbolic") +
+                            " link to \"" + member.LinkTarget + "\" doesn't lead to a regular file of the archive" });
+                        continue;
+                    }
+                }
+                else if (!member.Directory && !member.File)
+                {
+                    problems.push_back({ partition, destination + "/" + member.Path, "unsupported_member", "special files can't be stored in FAT" });
+                    continue;
+                }
+
+                // Every parent of the member, and the member itself when it is a directory
+                std::string path = destination + "/" + member.Path;
+                size_t end = member.Directory ? path.length() : path.find_last_of('/');
+                for (size_t slash = path.find('/', destination.length() + 1); std::min(slash, path.length()) <= end; slash = path.find('/', slash + 1))
+                {
+                    std::string directory = path.substr(0, slash);
+                    if (!directories.contains(getUpperPath(directory)))
+                    {
+                        if (!checkDestination(directory))
+                            break;
+                        directories.insert(getUpperPath(directory));
+                        archive.Directories.push_back(std::move(directory));
+                    }
+                    if (slash == std::string::npos)
+                        break;
+                }
+                if (member.Directory)
+                    continue;
+
+                if (target->Size > FAT_MAX_FILE_SIZE)
+                    problems.push_back({ partition, path, "file_too_large", std::to_string(target->Size) + " bytes, FAT32 files hold at most " + std::to_string(FAT_MAX_FILE_SIZE) });
+                ConfigurationFile configFile;
+                configFile.Source = archive.Source;
+                configFile.Destination = path;
+                configFile.Size = target->Size;
+                if (target != &member)
+                {
+                    links.push_back(std::move(configFile));
+                    continue;
+                }
+                checkDestination(path);
+                archive.Files.push_back(std::move(configFile));
+            }
+
+            // Links are written once the rest of the archive is in, and get their short names last
+            for (auto &link : links)
+            {
+                checkDestination(link.Destination);
+                archive.Files.push_back(std::move(link));
+            }
+        }
+    }
+
+    // Variants may only replace files of the base image
+    for (auto const &variant : config.Variants)
+    {
+        for (auto const &variantFile : variant.Files)
+        {
+            auto destinations = filesystemDestinations.find(variantFile.Partition);
+            if (destinations == filesystemDestinations.end() || !destinations->second.contains(getUpperPath(variantFile.Destination)))
+                problems.push_back({ variantFile.Partition, variantFile.Destination, "unknown_destination", "variant " + variant.Output + " replaces a file the base image doesn't have" });
+            checkSource(variantFile.Partition, variantFile.Source);
+        }
+    }
+
+    // Without a partition or with broken paths there is no layout to check
+    static std::unordered_set<std::string> const structuralProblems = { "missing_partition", "invalid_path", "invalid_name", "missing_parent", "duplicate_destination" };
+    if (!checkCapacity || std::any_of(problems.begin(), problems.end(), [](PreflightProblem const &problem) { return structuralProblems.contains(problem.Problem); }))
+        return;
+
+    // Sources which couldn't be read count as empty, the content is then a lower bound which may already not fit
+    Configuration lowerBound;
+    bool sizesUnknown = !problems.empty();
+    if (sizesUnknown)
+    {
+        lowerBound = config;
+        for (auto &configPartition : lowerBound.Partitions)
+        {
+            if (!configPartition.Content.empty() && !configPartition.ContentSize.has_value())
+                configPartition.ContentSize = 0;
+        }
+        for (auto &configFilesystem : lowerBound.Filesystems)
+        {
+            for (auto &configFile : configFilesystem.Files)
+            {
+                if (!configFile.Size.has_value())
+                    configFile.Size = 0;
+            }
+            for (auto &archive : configFilesystem.Archives)
+            {
+                for (auto &configFile : archive.Files)
+                {
+                    if (!configFile.Size.has_value())
+                        configFile.Size = 0;
+                }
+            }
+        }
+    }
+    Configuration const &layoutConfig = sizesUnknown ? lowerBound : config;
+    std::string atLeast = sizesUnknown ? "at least " : "";
+
+    std::vector<ConfigurationParitition> partitions;
+    std::unordered_map<std::string, DWORD> plannedClusterSizes;
+    if (planPartitions<SectorSize>(layoutConfig, partitions, plannedClusterSizes, false))
+    {
+        problems.push_back({ std::string(), std::string(), "no_layout", "no valid FAT32 geometry holds the content of an \"auto\" sized partition" });
+        return;
+    }
+
+    BasicGptDisk<SectorSize> gptDisk(layoutConfig.Output);
+    gptDisk.setAlignment(layoutConfig.Alignment);
+    gptDisk.configureDisk(partitions);
+    for (auto const &configFilesystem : layoutConfig.Filesystems)
+    {
+        BasicFat<SectorSize> fat(layoutConfig.Output, gptDisk.getPartition(utf8::utf8to16(configFilesystem.Partition)).value());
+        fat.setEraseBlockSize(layoutConfig.EraseBlockSize);
+        std::vector<std::string> directories = getDirectories(configFilesystem);
+        std::vector<FatFileSpec> files = getFileSpecs(configFilesystem, true);
+        auto plannedClusterSize = plannedClusterSizes.find(configFilesystem.Partition);
+        fat.setClusterSize(plannedClusterSize != plannedClusterSizes.end() ? plannedClusterSize->second : configFilesystem.ClusterSize);
+        if (configFilesystem.OptimizeClusterSize && plannedClusterSize == plannedClusterSizes.end())
+        {
+            std::optional<DWORD> clusterSize = fat.optimizeClusterSize(directories, files, false);
+            if (!clusterSize.has_value())
+            {
+                problems.push_back({ configFilesystem.Partition, std::string(), "no_space", "no cluster size gives a valid FAT32 cluster count that fits the content" });
+                continue;
+            }
+            fat.setClusterSize(clusterSize.value());
+        }
+
+        FatLayoutEstimate layoutEstimate;
+        if (!fat.estimateLayout(directories, files, layoutEstimate))
+            problems.push_back({ configFilesystem.Partition, std::string(), "invalid_geometry", "the partition can't hold a FAT32 filesystem with this cluster size" });
+        else if (!layoutEstimate.Fits)
+            problems.push_back({ configFilesystem.Partition, std::string(), "no_space", atLeast + std::to_string(layoutEstimate.FileClusters + layoutEstimate.DirectoryClusters +
+                layoutEstimate.PaddingClusters) + " clusters of " + std::to_string(layoutEstimate.ClusterSize) + " bytes needed, " +
+                std::to_string(layoutEstimate.ClusterCount) + " available" });
+    }
+}
+
+template <DWORD SectorSize>
+static bool extractArchive(BasicFat<SectorSize> &fat, ConfigurationArchive const& archive)
+{
+    // Members are taken in archive order and their data is read straight into their clusters,
+    // directories are created as they come up
+    bool standardInput = archive.Source == "-";
+    std::ifstream file;
+    if (!standardInput)
+    {
+        file.open(archive.Source, std::ios::in | std::ios::binary);
+        if (!file.is_open())
+            return false;
+    }
+    else
+        setBinaryStandardInput();
+
+    TarReader reader(standardInput ? std::cin : file, !standardInput);
+    std::string destination = archive.Destination == "/" ? std::string() : archive.Destination;
+    std::unordered_map<std::string, TarMember> members;
+    std::vector<std::string> links;
+    TarMember member;
+    while (reader.next(member))
+    {
+        if (member.Path.empty())
+            continue;
+        members[member.Path] = member;
+
+        // Links are copied once every regular file is written, their target may come later in the archive
+        if (member.HardLink || member.SymbolicLink)
+        {
+            links.push_back(member.Path);
+            continue;
+        }
+        if (!member.Directory && !member.File)
+            return false;
+
+        std::string path = destination + "/" + member.Path;
+        size_t lastSlash = path.find_last_of('/');
+        if (member.Directory)
+        {
+            if (!fat.ensureDirectory(path))
+                return false;
+            continue;
+        }
+
+        if (member.Size > FAT_MAX_FILE_SIZE || (lastSlash && !fat.ensureDirectory(path.substr(0, lastSlash))) ||
+            !fat.createFile(path, reader.getStream(), static_cast<DWORD>(member.Size), static_cast<std::time_t>(member.ModificationTime)))
+            return false;
+        reader.setDataRead(member.Size);
+    }
+    if (reader.hasFailed())
+        return false;
+
+    for (auto const &linkPath : links)
+    {
+        TarMember const *target = resolveLink(members, members[linkPath]);
+        std::string path = destination + "/" + linkPath;
+        size_t lastSlash = path.find_last_of('/');
+        if (!target || (lastSlash && !fat.ensureDirectory(path.substr(0, lastSlash))) ||
+            !fat.duplicateFile(path, destination + "/" + target->Path, static_cast<std::time_t>(target->ModificationTime)))
+            return false;
+    }
+
+    return true;
+}
+
+template <DWORD SectorSize>
+static int buildImage(Configuration const& config, SourceCache &sourceCache, Manifest *manifest, std::vector<std::unique_ptr<BasicFat<SectorSize>>> *openFilesystems, bool statistics = false, ImageEstimate *estimate = nullptr)
+{
+    // Remove instead of truncating, the old output may share its data with a cached image
+    std::error_code error;
+    std::filesystem::remove(config.Output, error);
+    std::ofstream f(config.Output);
     f.close();
 
-    GptDisk gptDisk(outputImagePath);
-    gptDisk.configureDisk(partitionConfig);
-    gptDisk.createDisk(); 
+    std::vector<ConfigurationParitition> partitions;
+    std::unordered_map<std::string, DWORD> plannedClusterSizes;
+    int ret = planPartitions<SectorSize>(config, partitions, plannedClusterSizes, statistics);
+    if (ret)
+        return ret;
 
-    for (auto const &jsonFilesystem : jsonConfig["filesystems"])
+    BasicGptDisk<SectorSize> gptDisk(config.Output);
+    if (config.Reproducible)
+        gptDisk.setSeed(config.Seed);
+    gptDisk.setAlignment(config.Alignment);
+    gptDisk.configureDisk(partitions);
+    gptDisk.createDisk();
+    if (estimate)
+        estimate->BytesWritten += gptDisk.getMetadataSize();
+
+    // Content images are cloned or copied in kernel into their partition instead of going through the mapping
+    for (auto const &partition : partitions)
     {
-        std::u16string partitionName = utf8::utf8to16(jsonFilesystem["partition"].get<std::string>());
+        if (partition.Content.empty())
+            continue;
+        std::optional<GptPartition> diskPartition = gptDisk.getPartition(partition.PartitionName);
+        if (!diskPartition.has_value())
+            return 3;
+        if (!placeFile(partition.Content, config.Output, diskPartition->StartingLBA * SectorSize))
+            return 5;
+        if (estimate)
+            estimate->BytesWritten += getAllocatedSize(partition.Content);
+    }
+
+    for (auto const &configFilesystem : config.Filesystems)
+    {
+        std::u16string partitionName = utf8::utf8to16(configFilesystem.Partition);
         std::optional<GptPartition> diskPartition = gptDisk.getPartition(partitionName);
         if (!diskPartition.has_value())
-            return 3; 
+            return 3;
+
+        auto fatPtr = std::make_unique<BasicFat<SectorSize>>(config.Output, diskPartition.value());
+        BasicFat<SectorSize> &fat = *fatPtr;
+        fat.setSourceCache(&sourceCache);
+        if (config.Reproducible)
+            fat.setReproducible(config.SourceDateEpoch);
+        fat.setEraseBlockSize(config.EraseBlockSize);
+
+        std::vector<std::string> directories = getDirectories(configFilesystem);
+        std::vector<FatFileSpec> files = getFileSpecs(configFilesystem);
+        std::vector<FatFileSpec> plannedFiles = getFileSpecs(configFilesystem, true);
+
+        if (!selectClusterSize(fat, configFilesystem, directories, plannedFiles, plannedClusterSizes))
+            return 12;
+
+        // Calibration compares the build time with what the layout alone predicts
+        if (estimate)
+        {
+            FatLayoutEstimate layoutEstimate;
+            if (fat.estimateLayout(directories, plannedFiles, layoutEstimate))
+            {
+                estimate->BytesWritten += layoutEstimate.BytesWritten;
+                estimate->Files += layoutEstimate.Files;
+            }
+        }
 
-        Fat fat(outputImagePath, diskPartition.value());
-        fat.createFilesystem();
+        if (!fat.createFilesystem())
+            return 12;
         fat.openFilesystem();
 
-        for (auto const &jsonDirectory : jsonFilesystem["directories"])
+        if (!fat.reserveLayout(directories, plannedFiles))
+            return 4;
+
+        for (auto const &directory : directories)
         {
-            if (!fat.createDirectory(jsonDirectory.get<std::string>()))
+            if (!fat.createDirectory(directory))
                 return 4;
         }
 
-        for (auto const &jsonFile : jsonFilesystem["files"])
+        if (!fat.createFiles(files))
+            return 5;
+
+        for (auto const &archive : configFilesystem.Archives)
         {
-            if (!fat.createFile(jsonFile["destination"].get<std::string>(), jsonFile["source"].get<std::string>()))
+            if (!extractArchive(fat, archive))
                 return 5;
         }
 
+        if (manifest)
+        {
+            ManifestFilesystem manifestFilesystem;
+            manifestFilesystem.Partition = configFilesystem.Partition;
+            manifestFilesystem.StartingLBA = diskPartition->StartingLBA;
+            manifestFilesystem.LBACount = diskPartition->LBACount;
+
+            for (auto const &configFile : configFilesystem.Files)
+            {
+                ManifestFile manifestFile;
+                manifestFile.Source = configFile.Source;
+                manifestFile.Destination = configFile.Destination;
+                manifestFile.Placement = fat.getFilePlacement(configFile.Destination).value();
+                manifestFilesystem.Files.push_back(manifestFile);
+            }
+
+            manifest->Filesystems.push_back(std::move(manifestFilesystem));
+        }
+
+        if (statistics)
+        {
+            std::cout << configFilesystem.Partition << ": ";
+            fat.printStatistics();
+        }
+
+        // Watch mode keeps the filesystems mapped to patch them later
+        if (openFilesystems)
+        {
+            fat.syncFilesystem();
+            openFilesystems->push_back(std::move(fatPtr));
+        }
+        else
+            fat.closeFilesystem();
+    }
+
+    return 0;
+}
+
+static bool recordSourceStates(Manifest &manifest)
+{
+    for (auto &manifestFilesystem : manifest.Filesystems)
+    {
+        for (auto &manifestFile : manifestFilesystem.Files)
+        {
+            // Preallocated files are kept for the variants, there is no source to follow
+            if (manifestFile.Source.empty())
+            {
+                manifestFile.Size = manifestFile.Placement.Size;
+                manifestFile.ModificationTime = 0;
+                manifestFile.Hash = 0;
+                continue;
+            }
+            if (!getSourceState(manifestFile.Source, manifestFile.Size, manifestFile.ModificationTime) ||
+                !computeFileHash64(manifestFile.Source, manifestFile.Hash))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+template <DWORD SectorSize>
+static int buildVariants(Configuration const& config, SourceCache &sourceCache, Manifest const& baseManifest)
+{
+    // Every variant starts as a reflink (or sparse copy) of the base image,
+    // only its overridden files are written again
+    for (auto const &variant : config.Variants)
+    {
+        if (!copyFile(config.Output, variant.Output))
+            return 8;
+
+        size_t applied = 0;
+        for (auto const &manifestFilesystem : baseManifest.Filesystems)
+        {
+            std::vector<ConfigurationVariantFile const*> overrides;
+            for (auto const &variantFile : variant.Files)
+            {
+                if (variantFile.Partition == manifestFilesystem.Partition)
+                    overrides.push_back(&variantFile);
+            }
+            if (overrides.empty())
+                continue;
+
+            GptPartition partition;
+            partition.StartingLBA = manifestFilesystem.StartingLBA;
+            partition.LBACount = manifestFilesystem.LBACount;
+
+            BasicFat<SectorSize> fat(variant.Output, partition);
+            fat.setSourceCache(&sourceCache);
+            if (config.Reproducible)
+                fat.setReproducible(config.SourceDateEpoch);
+            if (!fat.loadFilesystem())
+                return 8;
+
+            for (auto const *variantFile : overrides)
+            {
+                auto manifestFile = std::find_if(manifestFilesystem.Files.begin(), manifestFilesystem.Files.end(),
+                    [variantFile](ManifestFile const &file) { return FatNameEqual()(file.Destination, variantFile->Destination); });
+                if (manifestFile == manifestFilesystem.Files.end())
+                {
+                    fat.closeFilesystem();
+                    return 9;
+                }
+
+                FatFilePlacement placement = manifestFile->Placement;
+                if (!fat.replaceFile(placement, variantFile->Source))
+                {
+                    fat.closeFilesystem();
+                    return 9;
+                }
+                applied++;
+            }
+
+            fat.closeFilesystem();
+        }
+
+        // Overrides may only replace files of the base image
+        if (applied != variant.Files.size())
+            return 9;
+    }
+
+    return 0;
+}
+
+static int replicateImage(Configuration const& config)
+{
+    // The finished image is read once and its data regions are cloned or copied to every extra output
+    for (auto const &extraOutput : config.ExtraOutputs)
+    {
+        if (!copyFile(config.Output, extraOutput))
+            return 10;
+    }
+
+    return 0;
+}
+
+template <DWORD SectorSize>
+static int watchImage(Configuration const& config, SourceCache &sourceCache)
+{
+    std::vector<std::unique_ptr<BasicFat<SectorSize>>> openFilesystems;
+    int ret = buildImage(config, sourceCache, nullptr, &openFilesystems);
+    if (ret)
+        return ret;
+
+    std::vector<WatchedFile<SectorSize>> watchedFiles;
+    for (size_t i = 0; i < openFilesystems.size(); i++)
+    {
+        for (auto const &configFile : config.Filesystems[i].Files)
+        {
+            if (!configFile.Source.empty())
+                watchedFiles.push_back({openFilesystems[i].get(), configFile.Source, configFile.Destination});
+        }
+    }
+
+    std::cout << "watching " << watchedFiles.size() << " files" << std::endl;
+    ret = watchSources(watchedFiles) ? 0 : 7;
+
+    for (auto &fat : openFilesystems)
+        fat->closeFilesystem();
+
+    return ret;
+}
+
+template <DWORD SectorSize>
+static bool updateImage(Configuration const& config, SourceCache &sourceCache, Manifest &manifest)
+{
+    // Only the sources whose content changed since the manifest was recorded are copied again,
+    // their clusters and directory entries are patched in place
+    for (auto &manifestFilesystem : manifest.Filesystems)
+    {
+        GptPartition partition;
+        partition.StartingLBA = manifestFilesystem.StartingLBA;
+        partition.LBACount = manifestFilesystem.LBACount;
+
+        BasicFat<SectorSize> fat(config.Output, partition);
+        fat.setSourceCache(&sourceCache);
+        if (config.Reproducible)
+            fat.setReproducible(config.SourceDateEpoch);
+        if (!fat.loadFilesystem())
+            return false;
+
+        for (auto &manifestFile : manifestFilesystem.Files)
+        {
+            if (manifestFile.Source.empty())
+                continue;
+
+            QWORD size;
+            INT64 modificationTime;
+            if (!getSourceState(manifestFile.Source, size, modificationTime))
+            {
+                fat.closeFilesystem();
+                return false;
+            }
+            if (size == manifestFile.Size && modificationTime == manifestFile.ModificationTime)
+                continue;
+
+            // A newer timestamp alone (fresh checkout) doesn't mean the content changed
+            QWORD hash;
+            if (!computeFileHash64(manifestFile.Source, hash))
+            {
+                fat.closeFilesystem();
+                return false;
+            }
+            manifestFile.ModificationTime = modificationTime;
+            if (size == manifestFile.Size && hash == manifestFile.Hash)
+            {
+                fat.touchFile(manifestFile.Placement, manifestFile.Source);
+                continue;
+            }
+
+            if (!fat.replaceFile(manifestFile.Placement, manifestFile.Source))
+            {
+                fat.closeFilesystem();
+                return false;
+            }
+            manifestFile.Size = size;
+            manifestFile.Hash = hash;
+        }
+
+        fat.closeFilesystem();
+    }
+
+    return true;
+}
+
+static double estimateBuildSeconds(ImageEstimate const& estimate, double scale)
+{
+    return scale * (estimate.Files * BUILD_MICROSECONDS_PER_FILE / 1e6 + static_cast<double>(estimate.BytesWritten) / BUILD_BYTES_PER_SECOND);
+}
+
+static double loadCalibration(std::string const& path, QWORD &builds)
+{
+    // Without a usable calibration the model is taken as it is
+    builds = 0;
+    std::ifstream in(path);
+    if (!in.is_open())
+        return 1.0;
+
+    json jsonCalibration = json::parse(in, nullptr, false);
+    if (!jsonCalibration.is_object() || !jsonCalibration.contains("scale") || !jsonCalibration.contains("builds") ||
+        !jsonCalibration["scale"].is_number() || !jsonCalibration["builds"].is_number_unsigned())
+        return 1.0;
+    builds = jsonCalibration["builds"].get<QWORD>();
+    return jsonCalibration["scale"].get<double>();
+}
+
+static bool saveCalibration(std::string const& path, double scale, QWORD builds)
+{
+    json jsonCalibration;
+    jsonCalibration["scale"] = scale;
+    jsonCalibration["builds"] = builds;
+
+    std::ofstream out(path);
+    out << jsonCalibration.dump(4) << std::endl;
+    return out.good();
+}
+
+template <DWORD SectorSize>
+static int dryRun(Configuration const& config, double scale)
+{
+    // Lays out the disk and every filesystem from the sizes of the sources, the output is never written
+    std::vector<ConfigurationParitition> partitions;
+    std::unordered_map<std::string, DWORD> plannedClusterSizes;
+    int ret = planPartitions<SectorSize>(config, partitions, plannedClusterSizes, false);
+    if (ret)
+        return ret;
+
+    BasicGptDisk<SectorSize> gptDisk(config.Output);
+    gptDisk.setAlignment(config.Alignment);
+    gptDisk.configureDisk(partitions);
+
+    ImageEstimate estimate = { gptDisk.getMetadataSize(), 0 };
+    bool fits = true;
+    for (auto const &partition : partitions)
+    {
+        if (partition.Content.empty())
+            continue;
+        std::optional<GptPartition> diskPartition = gptDisk.getPartition(partition.PartitionName);
+        if (!diskPartition.has_value())
+            return 3;
+
+        std::cout << utf8::utf16to8(partition.PartitionName) << ": " << diskPartition->LBACount << " sectors at LBA " << diskPartition->StartingLBA
+            << ", " << partition.ContentSize.value_or(0) / 1024 << " KiB of content from " << partition.Content << std::endl;
+
+        // Holes of the content are skipped
+        estimate.BytesWritten += getAllocatedSize(partition.Content);
+    }
+    for (auto const &configFilesystem : config.Filesystems)
+    {
+        std::optional<GptPartition> diskPartition = gptDisk.getPartition(utf8::utf8to16(configFilesystem.Partition));
+        if (!diskPartition.has_value())
+            return 3;
+
+        BasicFat<SectorSize> fat(config.Output, diskPartition.value());
+        fat.setEraseBlockSize(config.EraseBlockSize);
+        std::vector<std::string> directories = getDirectories(configFilesystem);
+        std::vector<FatFileSpec> files = getFileSpecs(configFilesystem, true);
+        FatLayoutEstimate layoutEstimate;
+        if (!selectClusterSize(fat, configFilesystem, directories, files, plannedClusterSizes) ||
+            !fat.estimateLayout(directories, files, layoutEstimate))
+            return 12;
+
+        std::cout << configFilesystem.Partition << ": " << diskPartition->LBACount << " sectors at LBA " << diskPartition->StartingLBA
+            << ", " << layoutEstimate.ClusterSize << " byte clusters: " << layoutEstimate.ClusterCount << " clusters, "
+            << layoutEstimate.FileClusters << " file and " << layoutEstimate.DirectoryClusters << " directory clusters ("
+            << layoutEstimate.Directories << " directories), " << layoutEstimate.FreeClusters << " free, " << layoutEstimate.Slack / 1024
+            << " KiB slack, " << layoutEstimate.BytesWritten / 1024 << " KiB to write";
+        if (!layoutEstimate.Fits)
+            std::cout << ", does not fit";
+        std::cout << std::endl;
+
+        estimate.BytesWritten += layoutEstimate.BytesWritten;
+        estimate.Files += layoutEstimate.Files;
+        fits &= layoutEstimate.Fits;
+    }
+
+    std::cout << "image: " << gptDisk.getDiskSize().value() << " bytes, " << estimate.BytesWritten / 1024 << " KiB to write from "
+        << estimate.Files << " files, ~" << std::fixed << std::setprecision(2) << estimateBuildSeconds(estimate, scale) << " s" << std::endl;
+    return fits ? 0 : 5;
+}
+
+template <DWORD SectorSize>
+static int shrinkImage(std::string const& path)
+{
+    // The last partition is cut after its last used cluster and the backup GPT follows it,
+    // partitions without a FAT32 filesystem keep their size
+    BasicGptDisk<SectorSize> gptDisk(path);
+    if (!gptDisk.loadDisk())
+        return 13;
+
+    // An empty partition table has nothing to shrink
+    std::optional<GptPartition> lastPartition = gptDisk.getLastPartition();
+    if (!lastPartition.has_value())
+    {
+        std::cout << path << ": no partition to shrink" << std::endl;
+        return 0;
+    }
+
+    GptPartition partition = lastPartition.value();
+    QWORD lbaCount = partition.LBACount;
+    BasicFat<SectorSize> fat(path, partition);
+    if (fat.loadFilesystem())
+    {
+        lbaCount = fat.shrinkFilesystem();
         fat.closeFilesystem();
     }
 
+    std::error_code error;
+    QWORD oldSize = std::filesystem::file_size(path, error);
+    if (error || !gptDisk.resizeLastPartition(lbaCount))
+        return 13;
+    gptDisk.createDisk();
+    QWORD newSize = gptDisk.getDiskSize().value();
+    std::filesystem::resize_file(path, newSize, error);
+    if (error)
+        return 13;
+
+    std::cout << path << ": " << oldSize << " -> " << newSize << " bytes" << std::endl;
     return 0;
 }
+
+static int shrinkImage(std::string const& path)
+{
+    // A hard link into the build cache would shrink the cached image as well, the output gets its own copy
+    std::error_code error;
+    if (std::filesystem::hard_link_count(path, error) > 1 && !error)
+    {
+        std::string temporaryPath = path + ".tmp";
+        if (!copyFile(path, temporaryPath))
+            return 13;
+        std::filesystem::permissions(temporaryPath, std::filesystem::perms::owner_write, std::filesystem::perm_options::add, error);
+        std::filesystem::rename(temporaryPath, path, error);
+        if (error)
+        {
+            std::filesystem::remove(temporaryPath, error);
+            return 13;
+        }
+    }
+
+    // The primary GPT header sits in LBA 1, which tells the sector size apart
+    if (BasicGptDisk<SECTOR_SIZE_512>(path).loadDisk())
+        return shrinkImage<SECTOR_SIZE_512>(path);
+    return shrinkImage<SECTOR_SIZE_4K>(path);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string configPath;
+    std::optional<std::string> manifestPath;
+    bool watch = false;
+    std::optional<std::string> cacheDirectory;
+    QWORD cacheSizeLimit = DEFAULT_CACHE_SIZE_LIMIT;
+    bool reproducible = false;
+    std::string seed;
+    QWORD sourceCacheSizeLimit = DEFAULT_SOURCE_CACHE_SIZE_LIMIT;
+    std::string sourceCacheDirectory;
+    QWORD sourceCacheDiskLimit = DEFAULT_SOURCE_CACHE_DISK_LIMIT;
+    bool statistics = false;
+    std::optional<std::string> shrinkPath;
+    bool dryRunOnly = false;
+    std::optional<std::string> calibrationPath;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--manifest" && i + 1 < argc)
+            manifestPath = argv[++i];
+        else if (arg == "--watch")
+            watch = true;
+        else if (arg == "--cache" && i + 1 < argc)
+            cacheDirectory = argv[++i];
+        else if (arg == "--cache-size" && i + 1 < argc)
+            cacheSizeLimit = std::stoull(argv[++i]);
+        else if (arg == "--reproducible")
+            reproducible = true;
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            reproducible = true;
+            seed = argv[++i];
+        }
+        else if (arg == "--source-cache-size" && i + 1 < argc)
+            sourceCacheSizeLimit = std::stoull(argv[++i]);
+        else if (arg == "--source-cache" && i + 1 < argc)
+            sourceCacheDirectory = argv[++i];
+        else if (arg == "--source-cache-disk-size" && i + 1 < argc)
+            sourceCacheDiskLimit = std::stoull(argv[++i]);
+        else if (arg == "--stats")
+            statistics = true;
+        else if (arg == "--shrink" && i + 1 < argc)
+            shrinkPath = argv[++i];
+        else if (arg == "--dry-run")
+            dryRunOnly = true;
+        else if (arg == "--calibration" && i + 1 < argc)
+            calibrationPath = argv[++i];
+        else
+            configPath = arg;
+    }
+
+    if (shrinkPath.has_value())
+        return shrinkImage(shrinkPath.value());
+
+    if (configPath.empty())
+        return 1;
+
+    Configuration config;
+    int ret = loadConfiguration(configPath, config);
+    if (ret)
+        return ret;
+
+    // Cached images are only worth sharing if a rebuild would produce the same bytes
+    config.Reproducible = reproducible || cacheDirectory.has_value();
+    config.Seed = seed;
+    char const *sourceDateEpoch = std::getenv("SOURCE_DATE_EPOCH");
+    if (config.Reproducible && sourceDateEpoch)
+        config.SourceDateEpoch = std::stoll(sourceDateEpoch);
+
+    // Nothing is written unless every input checks out
+    std::vector<PreflightProblem> problems;
+    expandSourceDirectories(config, problems, statistics);
+    if (config.SectorSize == SECTOR_SIZE_4K)
+        preflight<SECTOR_SIZE_4K>(config, !dryRunOnly, problems);
+    else
+        preflight<SECTOR_SIZE_512>(config, !dryRunOnly, problems);
+    if (!problems.empty())
+    {
+        std::cerr << formatPreflightProblems(problems) << std::endl;
+        return 14;
+    }
+
+    QWORD calibratedBuilds = 0;
+    double scale = calibrationPath.has_value() ? loadCalibration(calibrationPath.value(), calibratedBuilds) : 1.0;
+    if (dryRunOnly)
+        return config.SectorSize == SECTOR_SIZE_4K ? dryRun<SECTOR_SIZE_4K>(config, scale) : dryRun<SECTOR_SIZE_512>(config, scale);
+
+    SourceCache sourceCache(sourceCacheSizeLimit, sourceCacheDirectory, sourceCacheDiskLimit);
+
+    if (watch)
+    {
+        // The image is patched behind the manifest's back, so it can't be trusted afterwards
+        if (manifestPath.has_value())
+        {
+            std::error_code error;
+            std::filesystem::remove(manifestPath.value(), error);
+        }
+        return config.SectorSize == SECTOR_SIZE_4K ? watchImage<SECTOR_SIZE_4K>(config, sourceCache) : watchImage<SECTOR_SIZE_512>(config, sourceCache);
+    }
+
+    // Reuse the existing image if it was built from the same configuration
+    Manifest manifest;
+    std::error_code error;
+    QWORD configHash = hashConfiguration(config);
+    // Archive members and content images aren't tracked by the manifest, a change is only noticed by rebuilding
+    bool untracked = std::any_of(config.Filesystems.begin(), config.Filesystems.end(),
+        [](ConfigurationFilesystem const &filesystem) { return !filesystem.Archives.empty(); }) ||
+        std::any_of(config.Partitions.begin(), config.Partitions.end(),
+        [](ConfigurationParitition const &partition) { return !partition.Content.empty(); });
+    if (manifestPath.has_value())
+    {
+        if (!untracked && loadManifest(manifestPath.value(), manifest) && manifest.ConfigHash == configHash &&
+            std::filesystem::file_size(config.Output, error) == manifest.ImageSize && !error &&
+            std::filesystem::hard_link_count(config.Output, error) == 1)
+        {
+            bool updated = config.SectorSize == SECTOR_SIZE_4K ? updateImage<SECTOR_SIZE_4K>(config, sourceCache, manifest) :
+                updateImage<SECTOR_SIZE_512>(config, sourceCache, manifest);
+            if (updated)
+            {
+                if (!saveManifest(manifestPath.value(), manifest))
+                    return 6;
+                ret = config.SectorSize == SECTOR_SIZE_4K ? buildVariants<SECTOR_SIZE_4K>(config, sourceCache, manifest) :
+                    buildVariants<SECTOR_SIZE_512>(config, sourceCache, manifest);
+                if (statistics)
+                    sourceCache.printStatistics();
+                return ret ? ret : replicateImage(config);
+            }
+        }
+
+        // Never leave a stale manifest behind an image which is about to be rebuilt
+        std::filesystem::remove(manifestPath.value(), error);
+        manifest.ConfigHash = configHash;
+        manifest.Filesystems.clear();
+    }
+
+    // Exact repeats of a previous build are served from the cache
+    std::optional<BuildCache> cache;
+    QWORD cacheKey;
+    bool cacheKeyValid = false;
+    if (cacheDirectory.has_value() && config.Variants.empty())
+    {
+        cache.emplace(cacheDirectory.value(), cacheSizeLimit);
+        cacheKeyValid = cache->computeKey(config, cacheKey);
+        if (cacheKeyValid && cache->fetch(cacheKey, config.Output))
+        {
+            cache->printStatistics();
+            return replicateImage(config);
+        }
+    }
+
+    // Variants need to know where the base image placed every file
+    bool recordPlacements = manifestPath.has_value() || !config.Variants.empty();
+    ImageEstimate estimate = {};
+    ImageEstimate *estimatePtr = calibrationPath.has_value() ? &estimate : nullptr;
+    auto buildStart = std::chrono::steady_clock::now();
+    if (config.SectorSize == SECTOR_SIZE_4K)
+        ret = buildImage<SECTOR_SIZE_4K>(config, sourceCache, recordPlacements ? &manifest : nullptr, nullptr, statistics, estimatePtr);
+    else
+        ret = buildImage<SECTOR_SIZE_512>(config, sourceCache, recordPlacements ? &manifest : nullptr, nullptr, statistics, estimatePtr);
+    if (ret)
+        return ret;
+
+    // Builds too short to time reliably leave the calibration alone
+    double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+    double modelSeconds = estimateBuildSeconds(estimate, 1.0);
+    if (calibrationPath.has_value() && modelSeconds > 0 && buildSeconds > 0.01)
+    {
+        QWORD builds = std::min<QWORD>(calibratedBuilds, CALIBRATION_BUILDS - 1);
+        scale = (scale * builds + buildSeconds / modelSeconds) / (builds + 1);
+        if (!saveCalibration(calibrationPath.value(), scale, calibratedBuilds + 1))
+            return 6;
+    }
+
+    ret = config.SectorSize == SECTOR_SIZE_4K ? buildVariants<SECTOR_SIZE_4K>(config, sourceCache, manifest) :
+        buildVariants<SECTOR_SIZE_512>(config, sourceCache, manifest);
+    if (ret)
+        return ret;
+
+    if (statistics)
+        sourceCache.printStatistics();
+
+    if (cache.has_value())
+    {
+        if (cacheKeyValid)
+            cache->store(cacheKey, config.Output);
+        cache->printStatistics();
+    }
+
+    if (manifestPath.has_value())
+    {
+        manifest.ImageSize = std::filesystem::file_size(config.Output, error);
+        if (error || !recordSourceStates(manifest) || !saveManifest(manifestPath.value(), manifest))
+            return 6;
+    }
+
+    return replicateImage(config);
+}
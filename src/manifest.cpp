@@ -0,0 +1,144 @@
+#include <manifest.hpp>
+
+#include <filesystem>
+#include <fstream>
+
+#include <json.hpp>
+
+using json = nlohmann::json;
+
+#define MANIFEST_VERSION 1
+
+static void readManifest(json const& jsonManifest, Manifest &manifest)
+{
+    manifest.ConfigHash = jsonManifest.at("config_hash").get<QWORD>();
+    manifest.ImageSize = jsonManifest.at("image_size").get<QWORD>();
+    manifest.Filesystems.clear();
+
+    for (auto const& jsonFilesystem : jsonManifest.at("filesystems"))
+    {
+        ManifestFilesystem filesystem;
+        filesystem.Partition = jsonFilesystem.at("partition").get<std::string>();
+        filesystem.StartingLBA = jsonFilesystem.at("starting_lba").get<QWORD>();
+        filesystem.LBACount = jsonFilesystem.at("lba_count").get<QWORD>();
+
+        for (auto const& jsonFile : jsonFilesystem.at("files"))
+        {
+            ManifestFile file;
+            file.Source = jsonFile.at("source").get<std::string>();
+            file.Destination = jsonFile.at("destination").get<std::string>();
+            file.Size = jsonFile.at("size").get<QWORD>();
+            file.ModificationTime = jsonFile.at("mtime").get<INT64>();
+            file.Hash = jsonFile.at("hash").get<QWORD>();
+            file.Placement.FirstCluster = jsonFile.at("first_cluster").get<DWORD>();
+            file.Placement.Size = jsonFile.at("placed_size").get<DWORD>();
+            file.Placement.EntryOffset = jsonFile.at("entry_offset").get<QWORD>();
+            filesystem.Files.push_back(file);
+        }
+
+        manifest.Filesystems.push_back(std::move(filesystem));
+    }
+}
+
+static std::string getManifestEncoding(std::string const& path)
+{
+    // Manifests of huge builds may be kept as CBOR or MessagePack, picked by the extension like configurations
+    std::string extension = std::filesystem::path(path).extension().string();
+    return extension == ".cbor" || extension == ".msgpack" ? extension : std::string();
+}
+
+bool loadManifest(std::string const& path, Manifest &manifest)
+{
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    std::string encoding = getManifestEncoding(path);
+    json jsonManifest = encoding == ".cbor" ? json::from_cbor(in, true, false) :
+        encoding == ".msgpack" ? json::from_msgpack(in, true, false) : json::parse(in, nullptr, false);
+    in.close();
+    if (!jsonManifest.is_object() || jsonManifest.value("version", 0) != MANIFEST_VERSION)
+        return false;
+
+    // A manifest which doesn't have the expected shape is treated like a missing one
+    try
+    {
+        readManifest(jsonManifest, manifest);
+    }
+    catch (json::exception const&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool saveManifest(std::string const& path, Manifest const& manifest)
+{
+    json jsonManifest;
+    jsonManifest["version"] = MANIFEST_VERSION;
+    jsonManifest["config_hash"] = manifest.ConfigHash;
+    jsonManifest["image_size"] = manifest.ImageSize;
+    jsonManifest["filesystems"] = json::array();
+
+    for (auto const& filesystem : manifest.Filesystems)
+    {
+        json jsonFilesystem;
+        jsonFilesystem["partition"] = filesystem.Partition;
+        jsonFilesystem["starting_lba"] = filesystem.StartingLBA;
+        jsonFilesystem["lba_count"] = filesystem.LBACount;
+        jsonFilesystem["files"] = json::array();
+
+        for (auto const& file : filesystem.Files)
+        {
+            json jsonFile;
+            jsonFile["source"] = file.Source;
+            jsonFile["destination"] = file.Destination;
+            jsonFile["size"] = file.Size;
+            jsonFile["mtime"] = file.ModificationTime;
+            jsonFile["hash"] = file.Hash;
+            jsonFile["first_cluster"] = file.Placement.FirstCluster;
+            jsonFile["placed_size"] = file.Placement.Size;
+            jsonFile["entry_offset"] = file.Placement.EntryOffset;
+            jsonFilesystem["files"].push_back(std::move(jsonFile));
+        }
+
+        jsonManifest["filesystems"].push_back(std::move(jsonFilesystem));
+    }
+
+    // Write to a temporary file first, a half written manifest must never look valid
+    std::string temporaryPath = path + ".tmp";
+    std::ofstream out(temporaryPath, std::ios::out | std::ios::binary);
+    if (!out.is_open())
+        return false;
+    std::string encoding = getManifestEncoding(path);
+    if (encoding.empty())
+        out << jsonManifest.dump(1, '\t');
+    else
+    {
+        std::vector<std::uint8_t> encoded = encoding == ".cbor" ? json::to_cbor(jsonManifest) : json::to_msgpack(jsonManifest);
+        out.write(reinterpret_cast<char const*>(encoded.data()), encoded.size());
+    }
+    out.close();
+    if (out.fail())
+        return false;
+
+    std::error_code error;
+    std::filesystem::rename(temporaryPath, path, error);
+    return !error;
+}
+
+bool getSourceState(std::string const& path, QWORD &size, INT64 &modificationTime)
+{
+    std::error_code error;
+    size = std::filesystem::file_size(path, error);
+    if (error)
+        return false;
+
+    auto writeTime = std::filesystem::last_write_time(path, error);
+    if (error)
+        return false;
+    modificationTime = writeTime.time_since_epoch().count();
+
+    return true;
+}
@@ -0,0 +1,97 @@
+#include <preflight.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <system_error>
+#include <thread>
+
+#include <json.hpp>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <filesystem>
+#endif
+
+using json = nlohmann::json;
+
+// Paths handed to a thread at a time, and the most threads worth starting for metadata lookups
+#define PREFLIGHT_BATCH_SIZE 64
+#define PREFLIGHT_MAX_THREADS 16
+
+#ifdef __linux__
+
+static void statSource(PreflightSource &source)
+{
+    // Only the type and the size are needed, statx doesn't have to fetch anything else
+    struct statx sb;
+    if (statx(AT_FDCWD, source.Path.c_str(), 0, STATX_TYPE | STATX_SIZE, &sb) == -1)
+    {
+        source.Error = std::generic_category().message(errno);
+        source.RegularFile = false;
+        source.Size = 0;
+        return;
+    }
+
+    source.Error.clear();
+    source.RegularFile = S_ISREG(sb.stx_mode);
+    source.Size = sb.stx_size;
+}
+
+#else
+
+static void statSource(PreflightSource &source)
+{
+    std::error_code error;
+    auto status = std::filesystem::status(source.Path, error);
+    source.RegularFile = !error && std::filesystem::is_regular_file(status);
+    source.Size = source.RegularFile ? std::filesystem::file_size(source.Path, error) : 0;
+    source.Error = error ? error.message() : std::string();
+}
+
+#endif
+
+void statSources(std::vector<PreflightSource> &sources)
+{
+    // Lookups on cold caches or network filesystems mostly wait, so they are spread over threads
+    // which take batches of paths until none are left
+    std::atomic<size_t> next = 0;
+    auto worker = [&sources, &next]()
+    {
+        for (size_t first = next.fetch_add(PREFLIGHT_BATCH_SIZE); first < sources.size(); first = next.fetch_add(PREFLIGHT_BATCH_SIZE))
+        {
+            size_t last = std::min(first + PREFLIGHT_BATCH_SIZE, sources.size());
+            for (size_t i = first; i < last; i++)
+                statSource(sources[i]);
+        }
+    };
+
+    size_t threadCount = std::min<size_t>({ std::max(std::thread::hardware_concurrency(), 1u), PREFLIGHT_MAX_THREADS,
+        (sources.size() + PREFLIGHT_BATCH_SIZE - 1) / PREFLIGHT_BATCH_SIZE });
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &thread : threads)
+        thread.join();
+}
+
+std::string formatPreflightProblems(std::vector<PreflightProblem> const& problems)
+{
+    json jsonProblems = json::array();
+    for (auto const& problem : problems)
+    {
+        json jsonProblem;
+        jsonProblem["partition"] = problem.Partition;
+        jsonProblem["path"] = problem.Path;
+        jsonProblem["problem"] = problem.Problem;
+        jsonProblem["detail"] = problem.Detail;
+        jsonProblems.push_back(std::move(jsonProblem));
+    }
+
+    json jsonReport;
+    jsonReport["problems"] = std::move(jsonProblems);
+    return jsonReport.dump(4);
+}
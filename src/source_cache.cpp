@@ -0,0 +1,298 @@
+#include <source_cache.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include <hash.hpp>
+
+// Only small files are worth keeping in memory, big ones are copied from the image
+#define SOURCE_CACHE_MAX_MEMORY_FILE (1 << 20)
+
+#define SOURCE_CACHE_ENTRY_EXTENSION ".src"
+
+SourceCache::SourceCache(QWORD cacheMemoryLimit, std::string const& cacheDirectory, QWORD cacheDiskLimit) : memoryLimit(cacheMemoryLimit), memoryUsed(0),
+    directory(cacheDirectory), diskLimit(cacheDiskLimit), diskUsed(0), lookups(0), memoryHits(0), imageHits(0), diskHits(0), bytesServed(0)
+{
+    if (directory.empty())
+        return;
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    evict(diskLimit);
+}
+
+#ifdef _WIN32
+
+static bool getSourceKey(std::string const& sourcePath, std::string &key, QWORD &size)
+{
+    std::error_code error;
+    size = std::filesystem::file_size(sourcePath, error);
+    if (error)
+        return false;
+    auto writeTime = std::filesystem::last_write_time(sourcePath, error);
+    if (error)
+        return false;
+
+    key = sourcePath;
+    key += '\0';
+    key += std::to_string(size) + ':' + std::to_string(writeTime.time_since_epoch().count());
+    return true;
+}
+
+#else
+
+static bool getSourceKey(std::string const& sourcePath, std::string &key, QWORD &size)
+{
+    struct stat sb;
+    if (stat(sourcePath.c_str(), &sb) == -1)
+        return false;
+
+    // Any change to the content shows up in the size, the modification time or the inode
+    size = sb.st_size;
+    key = sourcePath;
+    key += '\0';
+    key += std::to_string(sb.st_size) + ':' + std::to_string(sb.st_mtime) + '.' + std::to_string(sb.st_mtim.tv_nsec) +
+        ':' + std::to_string(sb.st_dev) + ':' + std::to_string(sb.st_ino);
+    return true;
+}
+
+#endif
+
+void SourceCache::touchMemory(CachedSource &source, std::string const& key)
+{
+    memoryLru.erase(source.memoryPosition);
+    memoryLru.push_front(key);
+    source.memoryPosition = memoryLru.begin();
+}
+
+std::optional<SourceCacheEntry> SourceCache::find(std::string const& sourcePath, std::string &key)
+{
+    lookups++;
+
+    QWORD size;
+    key.clear();
+    if (!getSourceKey(sourcePath, key, size))
+        return {};
+
+    auto it = sources.find(key);
+    if (it == sources.end())
+    {
+        // Sources seen by an earlier build are copied from the cache directory
+        auto spilled = findSpilled(key, size);
+        if (!spilled.has_value())
+            return {};
+
+        CachedSource source;
+        source.entry = spilled.value();
+        source.memoryPosition = memoryLru.end();
+        sources.emplace(key, std::move(source));
+        return spilled;
+    }
+
+    if (it->second.entry.Data)
+        touchMemory(it->second, key);
+    return it->second.entry;
+}
+
+std::string SourceCache::getSpillPath(std::string const& key)
+{
+    char name[17];
+    QWORD hash = computeHash64(reinterpret_cast<BYTE const*>(key.data()), key.size());
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    return (std::filesystem::path(directory) / (std::string(name) + SOURCE_CACHE_ENTRY_EXTENSION)).string();
+}
+
+std::optional<SourceCacheEntry> SourceCache::findSpilled(std::string const& key, QWORD size)
+{
+    if (directory.empty())
+        return {};
+
+    // Every entry starts with the full key, a hash collision must not serve another source
+    std::string spillPath = getSpillPath(key);
+    std::ifstream in(spillPath, std::ios::in | std::ios::binary);
+    DWORD keyLength = 0;
+    in.read(reinterpret_cast<char*>(&keyLength), sizeof(DWORD));
+    if (!in || keyLength != key.size())
+        return {};
+    std::string entryKey(keyLength, '\0');
+    in.read(entryKey.data(), keyLength);
+    if (!in || entryKey != key)
+        return {};
+
+    std::error_code error;
+    QWORD dataOffset = sizeof(DWORD) + keyLength;
+    if (std::filesystem::file_size(spillPath, error) != dataOffset + size || error)
+        return {};
+
+    // Entries are evicted by least recent use, the modification time tracks the last hit
+    std::filesystem::last_write_time(spillPath, std::filesystem::file_time_type::clock::now(), error);
+
+    SourceCacheEntry entry;
+    entry.Size = size;
+    entry.ImagePath = spillPath;
+    entry.ImageOffset = dataOffset;
+    entry.Spilled = true;
+    return entry;
+}
+
+void SourceCache::spill(std::string const& key, QWORD size, BYTE const *data)
+{
+    std::string spillPath = getSpillPath(key);
+    std::string temporaryPath = spillPath + ".tmp";
+    {
+        std::ofstream out(temporaryPath, std::ios::out | std::ios::binary | std::ios::trunc);
+        DWORD keyLength = static_cast<DWORD>(key.size());
+        out.write(reinterpret_cast<char const*>(&keyLength), sizeof(DWORD));
+        out.write(key.data(), keyLength);
+        out.write(reinterpret_cast<char const*>(data), size);
+        if (!out)
+        {
+            out.close();
+            std::error_code error;
+            std::filesystem::remove(temporaryPath, error);
+            return;
+        }
+    }
+
+    // Builds running side by side only ever see complete entries
+    std::error_code error;
+    std::filesystem::rename(temporaryPath, spillPath, error);
+    if (error)
+    {
+        std::filesystem::remove(temporaryPath, error);
+        return;
+    }
+
+    // Evicting a quarter below the limit keeps a build over the limit from scanning the directory for every file
+    diskUsed += sizeof(DWORD) + key.size() + size;
+    if (diskUsed > diskLimit)
+        evict(diskLimit / 4 * 3);
+}
+
+void SourceCache::evict(QWORD targetSize)
+{
+    struct Entry
+    {
+        std::filesystem::path path;
+        std::filesystem::file_time_type lastUse;
+        QWORD size;
+    };
+
+    std::vector<Entry> entries;
+    diskUsed = 0;
+    std::error_code error;
+    for (auto const& dirEntry : std::filesystem::directory_iterator(directory, error))
+    {
+        if (dirEntry.path().extension() != SOURCE_CACHE_ENTRY_EXTENSION)
+            continue;
+        QWORD size = dirEntry.file_size(error);
+        entries.push_back({dirEntry.path(), dirEntry.last_write_time(error), size});
+        diskUsed += size;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b) { return a.lastUse < b.lastUse; });
+    for (auto const& entry : entries)
+    {
+        if (diskUsed <= targetSize)
+            break;
+        std::filesystem::remove(entry.path, error);
+        diskUsed -= entry.size;
+    }
+}
+
+void SourceCache::recordHit(std::string const& key, SourceCacheEntry const& entry, BYTE const *data)
+{
+    // Only copies which actually came from the cache count, a failed one falls back to the source
+    if (entry.Data)
+        memoryHits++;
+    else if (entry.Spilled)
+        diskHits++;
+    else
+        imageHits++;
+    bytesServed += entry.Size;
+
+    // A source placed more than once is likely placed again, data is the copy just written
+    auto it = sources.find(key);
+    if (it != sources.end() && !it->second.entry.Data)
+        keepInMemory(it->second, key, data);
+}
+
+void SourceCache::keepInMemory(CachedSource &source, std::string const& key, BYTE const *data)
+{
+    QWORD size = source.entry.Size;
+    if (size > SOURCE_CACHE_MAX_MEMORY_FILE || size > memoryLimit)
+        return;
+
+    // Drop the data of the least recently used sources, their placements are still known
+    while (memoryUsed + size > memoryLimit)
+    {
+        CachedSource &victim = sources[memoryLru.back()];
+        memoryUsed -= victim.entry.Size;
+        victim.entry.Data.reset();
+        victim.memoryPosition = memoryLru.end();
+        memoryLru.pop_back();
+    }
+
+    source.entry.Data = std::make_shared<std::vector<BYTE> const>(data, data + size);
+    memoryUsed += size;
+    memoryLru.push_front(key);
+    source.memoryPosition = memoryLru.begin();
+}
+
+void SourceCache::insert(std::string const& key, QWORD size, BYTE const *data, std::string const& imagePath, QWORD imageOffset)
+{
+    if (key.empty() || sources.contains(key))
+        return;
+
+    CachedSource source;
+    source.entry.Size = size;
+    source.entry.ImagePath = imagePath;
+    source.entry.ImageOffset = imageOffset;
+    source.entry.Spilled = false;
+    source.memoryPosition = memoryLru.end();
+
+    // The image may be rewritten later on, the cache directory keeps a copy for the next builds
+    if (!directory.empty() && size <= diskLimit)
+        spill(key, size, data);
+
+    // Most sources are placed once, only the placement is kept until one is placed again
+    sources.emplace(key, std::move(source));
+}
+
+void SourceCache::invalidateImage(std::string const& imagePath)
+{
+    // Clusters of that image may have been reused, only copies held in memory or in the cache directory stay valid
+    for (auto it = sources.begin(); it != sources.end(); )
+    {
+        if (it->second.entry.ImagePath == imagePath && !it->second.entry.Data)
+            it = sources.erase(it);
+        else
+        {
+            if (it->second.entry.ImagePath == imagePath)
+                it->second.entry.ImageOffset = UINT64_MAX;
+            it++;
+        }
+    }
+}
+
+void SourceCache::printStatistics()
+{
+    QWORD hits = memoryHits + imageHits + diskHits;
+    std::cout << "source cache: " << lookups << " lookups, " << memoryHits << " memory hits, " << imageHits << " image hits";
+    if (!directory.empty())
+        std::cout << ", " << diskHits << " disk hits";
+    if (lookups)
+        std::cout << " (" << (hits * 100 / lookups) << "% hit rate)";
+    std::cout << ", " << bytesServed << " bytes served, " << memoryUsed << " bytes held in memory";
+    if (!directory.empty())
+        std::cout << ", " << diskUsed << " bytes in " << directory;
+    std::cout << std::endl;
+}
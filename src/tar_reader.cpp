@@ -0,0 +1,346 @@
+#include <tar_reader.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <optional>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#define TAR_BLOCK_SIZE 512
+
+// Offsets in the ustar header
+#define TAR_NAME 0
+#define TAR_NAME_SIZE 100
+#define TAR_SIZE 124
+#define TAR_MTIME 136
+#define TAR_CHKSUM 148
+#define TAR_TYPEFLAG 156
+#define TAR_LINKNAME 157
+#define TAR_LINKNAME_SIZE 100
+#define TAR_MAGIC 257
+#define TAR_PREFIX 345
+#define TAR_PREFIX_SIZE 155
+
+// Extended headers longer than this are taken as a corrupt archive
+#define TAR_MAX_EXTENDED_HEADER (1 << 20)
+
+// Links followed before giving up on a loop, as SYMLOOP_MAX on Linux
+#define TAR_MAX_LINK_DEPTH 40
+
+static bool parseNumber(char const *field, size_t length, QWORD &value)
+{
+    // Octal, or big endian base-256 when the high bit of the first byte is set (GNU, for large sizes)
+    value = 0;
+    if (static_cast<BYTE>(field[0]) & 0x80)
+    {
+        for (size_t i = 0; i < length; i++)
+            value = (value << 8) | static_cast<BYTE>(i ? field[i] : field[i] & 0x7F);
+        return true;
+    }
+
+    size_t i = 0;
+    while (i < length && field[i] == ' ')
+        i++;
+    bool digits = false;
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; i++, digits = true)
+        value = (value << 3) | (field[i] - '0');
+    return digits && (i == length || field[i] == ' ' || field[i] == '\0');
+}
+
+static bool normalizePath(std::string &path)
+{
+    // Archives made with "tar -C dir ." prefix every member with ./. Absolute members are taken as
+    // relative, members reaching above the destination are refused
+    std::string normalized;
+    size_t start = 0;
+    while (start <= path.length())
+    {
+        size_t end = std::min(path.find('/', start), path.length());
+        std::string_view component = std::string_view(path).substr(start, end - start);
+        start = end + 1;
+        if (component.empty() || component == ".")
+            continue;
+        if (component == "..")
+            return false;
+        if (!normalized.empty())
+            normalized += '/';
+        normalized += component;
+    }
+
+    path = std::move(normalized);
+    return true;
+}
+
+TarReader::TarReader(std::istream &stream, bool seekableStream) :
+    in(stream),
+    seekable(seekableStream),
+    failed(false),
+    remaining(0),
+    padding(0)
+{
+}
+
+bool TarReader::skip(QWORD bytes)
+{
+    if (!bytes)
+        return true;
+    if (seekable)
+        in.seekg(bytes, std::ios::cur);
+    else
+    {
+        while (bytes)
+        {
+            std::streamsize chunk = static_cast<std::streamsize>(std::min<QWORD>(bytes, INT32_MAX));
+            in.ignore(chunk);
+            if (in.gcount() != chunk)
+                return false;
+            bytes -= chunk;
+        }
+    }
+    return static_cast<bool>(in);
+}
+
+bool TarReader::readBlock(char *block)
+{
+    in.read(block, TAR_BLOCK_SIZE);
+    return in.gcount() == TAR_BLOCK_SIZE;
+}
+
+bool TarReader::readText(QWORD size, std::string &text)
+{
+    // Data of an extended header, followed by the padding up to the next block
+    if (size > TAR_MAX_EXTENDED_HEADER)
+        return false;
+    text.resize(size);
+    in.read(text.data(), size);
+    return static_cast<QWORD>(in.gcount()) == size && skip((TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+bool TarReader::next(TarMember &member)
+{
+    if (failed || !skip(remaining + padding))
+    {
+        failed = true;
+        return false;
+    }
+    remaining = 0;
+    padding = 0;
+
+    // Extended headers (pax and GNU long names) apply to the next real header
+    std::string longPath;
+    std::string longLinkTarget;
+    std::optional<QWORD> extendedSize;
+    std::optional<INT64> extendedTime;
+    char block[TAR_BLOCK_SIZE];
+    while (true)
+    {
+        if (!readBlock(block))
+        {
+            failed = true;
+            return false;
+        }
+
+        // The archive ends with zero blocks
+        if (std::all_of(block, block + TAR_BLOCK_SIZE, [](char c) { return c == 0; }))
+            return false;
+
+        QWORD checksum;
+        if (!parseNumber(block + TAR_CHKSUM, 8, checksum))
+        {
+            failed = true;
+            return false;
+        }
+        QWORD sum = 0;
+        for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+            sum += i >= TAR_CHKSUM && i < TAR_CHKSUM + 8 ? ' ' : static_cast<BYTE>(block[i]);
+        QWORD size;
+        if (sum != checksum || !parseNumber(block + TAR_SIZE, 12, size))
+        {
+            failed = true;
+            return false;
+        }
+
+        char type = block[TAR_TYPEFLAG];
+        if (type == 'x' || type == 'g' || type == 'L' || type == 'K')
+        {
+            std::string text;
+            if (!readText(size, text))
+            {
+                failed = true;
+                return false;
+            }
+
+            if (type == 'L')
+                longPath = text.substr(0, text.find('\0'));
+            else if (type == 'K')
+                longLinkTarget = text.substr(0, text.find('\0'));
+            else if (type == 'x')
+            {
+                // Records are "<length> <key>=<value>\n", the length counting the whole record
+                for (size_t offset = 0; offset < text.length();)
+                {
+                    size_t space = text.find(' ', offset);
+                    size_t length = space == std::string::npos ? 0 : std::strtoull(text.c_str() + offset, nullptr, 10);
+                    if (!length || offset + length > text.length())
+                        break;
+                    std::string record = text.substr(space + 1, offset + length - space - 2);
+                    size_t equals = record.find('=');
+                    std::string key = record.substr(0, equals);
+                    std::string value = equals == std::string::npos ? std::string() : record.substr(equals + 1);
+                    if (key == "path")
+                        longPath = value;
+                    else if (key == "linkpath")
+                        longLinkTarget = value;
+                    else if (key == "size")
+                        extendedSize = std::strtoull(value.c_str(), nullptr, 10);
+                    else if (key == "mtime")
+                        extendedTime = std::strtoll(value.c_str(), nullptr, 10);
+                    offset += length;
+                }
+            }
+            continue;
+        }
+
+        QWORD modificationTime;
+        parseNumber(block + TAR_MTIME, 12, modificationTime);
+        member.Size = extendedSize.value_or(size);
+        member.ModificationTime = extendedTime.value_or(static_cast<INT64>(modificationTime));
+        member.Directory = type == '5';
+        member.File = type == '0' || type == '\0' || type == '7';
+        member.HardLink = type == '1';
+        member.SymbolicLink = type == '2';
+        member.LinkTarget.clear();
+        if (member.HardLink || member.SymbolicLink)
+            member.LinkTarget = !longLinkTarget.empty() ? longLinkTarget : std::string(block + TAR_LINKNAME, strnlen(block + TAR_LINKNAME, TAR_LINKNAME_SIZE));
+        if (!longPath.empty())
+            member.Path = longPath;
+        else
+        {
+            member.Path.assign(block + TAR_NAME, strnlen(block + TAR_NAME, TAR_NAME_SIZE));
+            if (std::memcmp(block + TAR_MAGIC, "ustar", 5) == 0 && block[TAR_PREFIX])
+                member.Path = std::string(block + TAR_PREFIX, strnlen(block + TAR_PREFIX, TAR_PREFIX_SIZE)) + "/" + member.Path;
+        }
+        if (!normalizePath(member.Path))
+        {
+            failed = true;
+            return false;
+        }
+
+        // Hard links name another member, one reaching above the archive can't be resolved
+        if (member.HardLink && !normalizePath(member.LinkTarget))
+            member.LinkTarget.clear();
+
+        // Links have no data whatever their size field says
+        QWORD dataSize = type == '1' || type == '2' ? 0 : member.Size;
+        remaining = dataSize;
+        padding = (TAR_BLOCK_SIZE - dataSize % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        return true;
+    }
+}
+
+bool TarReader::hasFailed() const
+{
+    return failed;
+}
+
+std::istream &TarReader::getStream()
+{
+    return in;
+}
+
+void TarReader::setDataRead(QWORD bytes)
+{
+    remaining -= std::min(bytes, remaining);
+}
+
+void setBinaryStandardInput()
+{
+    // Archives are binary, stdin must not translate line endings
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+}
+
+bool scanArchive(std::string const& path, std::vector<TarMember> &members, std::string &error)
+{
+    // Only the headers are read, the data of every member is seeked over
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in.is_open())
+    {
+        error = "can't open the archive";
+        return false;
+    }
+
+    TarReader reader(in, true);
+    TarMember member;
+    while (reader.next(member))
+        members.push_back(member);
+    if (reader.hasFailed())
+    {
+        error = "truncated or corrupt archive";
+        return false;
+    }
+
+    return true;
+}
+
+static bool resolveSymbolicLink(std::string const& linkPath, std::string const& target, std::string &path)
+{
+    // Relative targets start from the directory of the link, absolute ones from the root of the archive
+    size_t lastSlash = linkPath.find_last_of('/');
+    std::string joined = (target.starts_with('/') || lastSlash == std::string::npos ? std::string() : linkPath.substr(0, lastSlash)) + "/" + target;
+    std::vector<std::string_view> components;
+    size_t start = 0;
+    while (start <= joined.length())
+    {
+        size_t end = std::min(joined.find('/', start), joined.length());
+        std::string_view component = std::string_view(joined).substr(start, end - start);
+        start = end + 1;
+        if (component.empty() || component == ".")
+            continue;
+        if (component == "..")
+        {
+            if (components.empty())
+                return false;
+            components.pop_back();
+            continue;
+        }
+        components.push_back(component);
+    }
+
+    path.clear();
+    for (auto const &component : components)
+    {
+        if (!path.empty())
+            path += '/';
+        path += component;
+    }
+    return true;
+}
+
+TarMember const *resolveLink(std::unordered_map<std::string, TarMember> const& members, TarMember const& link)
+{
+    // Follows hard and symbolic links to the member they stand for, nullptr when the chain leaves the
+    // archive, loops or ends on anything but a regular file
+    TarMember const *member = &link;
+    for (DWORD depth = 0; depth < TAR_MAX_LINK_DEPTH; depth++)
+    {
+        if (member->File)
+            return member;
+        if (!member->HardLink && !member->SymbolicLink)
+            return nullptr;
+
+        std::string targetPath = member->LinkTarget;
+        if (member->SymbolicLink && !resolveSymbolicLink(member->Path, member->LinkTarget, targetPath))
+            return nullptr;
+        auto it = members.find(targetPath);
+        if (targetPath.empty() || it == members.end())
+            return nullptr;
+        member = &it->second;
+    }
+    return nullptr;
+}
@@ -0,0 +1,213 @@
+#include <tree_walk.hpp>
+
+#include <algorithm>
+#include <system_error>
+
+#ifdef __linux__
+#include <cerrno>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <filesystem>
+#endif
+
+// Directory listings wait on the disk much more than on the CPU
+#define TREE_WALK_MAX_THREADS 16
+
+static bool matchGlobAt(std::string_view pattern, std::string_view path)
+{
+    while (!pattern.empty())
+    {
+        if (pattern.starts_with("**"))
+        {
+            // Any number of whole components, including none when followed by a slash
+            pattern.remove_prefix(2);
+            if (pattern.starts_with('/') && matchGlobAt(pattern.substr(1), path))
+                return true;
+            for (size_t i = 0; i <= path.length(); i++)
+            {
+                if (matchGlobAt(pattern, path.substr(i)))
+                    return true;
+            }
+            return false;
+        }
+
+        if (pattern[0] == '*')
+        {
+            pattern.remove_prefix(1);
+            for (size_t i = 0; i <= path.length() && (i == 0 || path[i - 1] != '/'); i++)
+            {
+                if (matchGlobAt(pattern, path.substr(i)))
+                    return true;
+            }
+            return false;
+        }
+
+        if (path.empty() || (pattern[0] == '?' ? path[0] == '/' : pattern[0] != path[0]))
+            return false;
+        pattern.remove_prefix(1);
+        path.remove_prefix(1);
+    }
+
+    return path.empty();
+}
+
+bool matchGlob(std::string_view pattern, std::string_view path)
+{
+    // * and ? stay within a component, ** spans components. A pattern without a slash
+    // is matched against the last component only
+    if (pattern.find('/') == std::string_view::npos)
+        path = path.substr(path.find_last_of('/') + 1);
+    return matchGlobAt(pattern, path);
+}
+
+static bool matchAny(std::span<std::string const> patterns, std::string_view path)
+{
+    return std::any_of(patterns.begin(), patterns.end(), [path](std::string const &pattern) { return matchGlob(pattern, path); });
+}
+
+#ifdef __linux__
+
+bool walkTree(std::string const& root, std::span<std::string const> include, std::span<std::string const> exclude, std::vector<TreeEntry> &entries, std::string &error)
+{
+    // Workers take directories from a shared queue, open them relative to the root with openat
+    // and queue their subdirectories. Symbolic links are followed to files but never into directories
+    int rootFd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd == -1)
+    {
+        error = std::generic_category().message(errno);
+        return false;
+    }
+
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    std::vector<std::string> pending = { std::string() };
+    size_t busy = 0;
+    error.clear();
+
+    auto listDirectory = [&](std::string const& directoryPath, std::vector<TreeEntry> &found, std::vector<std::string> &subdirectories) -> bool
+    {
+        int fd = openat(rootFd, directoryPath.empty() ? "." : directoryPath.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR *dir = fd == -1 ? nullptr : fdopendir(fd);
+        if (!dir)
+        {
+            if (fd != -1)
+                close(fd);
+            return false;
+        }
+
+        while (dirent *entry = readdir(dir))
+        {
+            std::string_view name = entry->d_name;
+            if (name == "." || name == "..")
+                continue;
+
+            bool directory = entry->d_type == DT_DIR;
+            bool file = entry->d_type == DT_REG;
+            if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+            {
+                struct stat sb;
+                if (fstatat(dirfd(dir), entry->d_name, &sb, entry->d_type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+                    continue;
+                directory = entry->d_type == DT_UNKNOWN && S_ISDIR(sb.st_mode);
+                file = S_ISREG(sb.st_mode);
+            }
+            if (!directory && !file)
+                continue;
+
+            std::string path = directoryPath.empty() ? std::string(name) : directoryPath + "/" + std::string(name);
+            if (matchAny(exclude, path) || (file && !include.empty() && !matchAny(include, path)))
+                continue;
+            if (directory)
+                subdirectories.push_back(path);
+            found.push_back({ std::move(path), directory });
+        }
+
+        closedir(dir);
+        return true;
+    };
+
+    auto worker = [&]()
+    {
+        std::vector<TreeEntry> found;
+        std::vector<std::string> subdirectories;
+        std::unique_lock lock(mutex);
+        while (true)
+        {
+            wakeUp.wait(lock, [&]() { return !pending.empty() || busy == 0; });
+            if (pending.empty())
+                break;
+
+            std::string directoryPath = std::move(pending.back());
+            pending.pop_back();
+            busy++;
+            lock.unlock();
+
+            subdirectories.clear();
+            bool listed = listDirectory(directoryPath, found, subdirectories);
+            int listError = errno;
+
+            lock.lock();
+            if (!listed && error.empty())
+                error = (directoryPath.empty() ? root : directoryPath) + ": " + std::generic_category().message(listError);
+            std::move(subdirectories.begin(), subdirectories.end(), std::back_inserter(pending));
+            busy--;
+            wakeUp.notify_all();
+        }
+
+        std::move(found.begin(), found.end(), std::back_inserter(entries));
+    };
+
+    entries.clear();
+    size_t threadCount = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), TREE_WALK_MAX_THREADS);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &thread : threads)
+        thread.join();
+    close(rootFd);
+
+    // Parents sort ahead of their children, and files of the same directory end up next to each other
+    std::sort(entries.begin(), entries.end(), [](TreeEntry const &a, TreeEntry const &b) { return a.Path < b.Path; });
+    return error.empty();
+}
+
+#else
+
+bool walkTree(std::string const& root, std::span<std::string const> include, std::span<std::string const> exclude, std::vector<TreeEntry> &entries, std::string &error)
+{
+    std::error_code errorCode;
+    entries.clear();
+    std::filesystem::recursive_directory_iterator it(root, errorCode), end;
+    for (; !errorCode && it != end; it.increment(errorCode))
+    {
+        std::string path = std::filesystem::relative(it->path(), root, errorCode).generic_string();
+        bool directory = it->is_directory(errorCode) && !it->is_symlink(errorCode);
+        bool file = it->is_regular_file(errorCode);
+        if (matchAny(exclude, path) || (!directory && !file))
+        {
+            if (directory)
+                it.disable_recursion_pending();
+            continue;
+        }
+        if (directory || include.empty() || matchAny(include, path))
+            entries.push_back({ std::move(path), directory });
+    }
+
+    if (errorCode)
+    {
+        error = errorCode.message();
+        return false;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](TreeEntry const &a, TreeEntry const &b) { return a.Path < b.Path; });
+    return true;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#include <watch.hpp>
+
+#ifdef __linux__
+
+#include <csignal>
+#include <filesystem>
+#include <iostream>
+#include <set>
+#include <unordered_map>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Editors tend to save in bursts (truncate, write, rename), wait for them to settle
+#define WATCH_SETTLE_MS 50
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void onStopSignal(int)
+{
+    stopRequested = 1;
+}
+
+template <DWORD SectorSize>
+bool watchSources(std::vector<WatchedFile<SectorSize>> const& files)
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    // Watch the parent directories and not the files, saving through a rename replaces the inode
+    std::unordered_map<int, std::unordered_map<std::string, std::vector<WatchedFile<SectorSize> const*>>> watches;
+    for (auto const& file : files)
+    {
+        std::filesystem::path sourcePath(file.Source);
+        std::string parent = sourcePath.parent_path().string();
+        if (parent.empty())
+            parent = ".";
+
+        int wd = inotify_add_watch(fd, parent.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (wd == -1)
+        {
+            close(fd);
+            return false;
+        }
+        watches[wd][sourcePath.filename().string()].push_back(&file);
+    }
+
+    std::signal(SIGINT, onStopSignal);
+    std::signal(SIGTERM, onStopSignal);
+
+    alignas(struct inotify_event) char buffer[16384];
+    std::set<WatchedFile<SectorSize> const*> pending;
+    while (!stopRequested)
+    {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, pending.empty() ? -1 : WATCH_SETTLE_MS);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (!ready)
+        {
+            // Quiet period, patch everything which changed
+            std::set<BasicFat<SectorSize>*> touched;
+            for (auto const* file : pending)
+            {
+                if (!file->Filesystem->updateFile(file->Destination, file->Source))
+                    std::cerr << "failed to update " << file->Destination << " from " << file->Source << std::endl;
+                else
+                    std::cout << "updated " << file->Destination << std::endl;
+                touched.insert(file->Filesystem);
+            }
+            for (auto *filesystem : touched)
+                filesystem->syncFilesystem();
+            pending.clear();
+            continue;
+        }
+
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length <= 0)
+            continue;
+
+        for (char *ptr = buffer; ptr < buffer + length; )
+        {
+            struct inotify_event *event = reinterpret_cast<struct inotify_event*>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (!event->len)
+                continue;
+
+            auto directory = watches.find(event->wd);
+            if (directory == watches.end())
+                continue;
+            auto watched = directory->second.find(event->name);
+            if (watched == directory->second.end())
+                continue;
+            pending.insert(watched->second.begin(), watched->second.end());
+        }
+    }
+
+    close(fd);
+    return true;
+}
+
+#else
+
+template <DWORD SectorSize>
+bool watchSources(std::vector<WatchedFile<SectorSize>> const& files)
+{
+    // Only inotify is supported for now
+    return false;
+}
+
+#endif
+
+template bool watchSources(std::vector<WatchedFile<SECTOR_SIZE_512>> const& files);
+template bool watchSources(std::vector<WatchedFile<SECTOR_SIZE_4K>> const& files);
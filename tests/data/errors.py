@@ -0,0 +1,14 @@
+class GptError(Exception):
+    pass
+
+
+class InvalidHeader(GptError):
+    def __init__(self, field, value):
+        super().__init__(f"invalid GPT header: {field} = {value!r}")
+        self.field = field
+        self.value = value
+
+
+class ChecksumMismatch(GptError):
+    def __init__(self, what, expected, actual):
+        super().__init__(f"{what} CRC32 is {actual:#010x}, expected {expected:#010x}")
@@ -0,0 +1,77 @@
+import struct
+import uuid
+import zlib
+from dataclasses import dataclass
+
+from errors import ChecksumMismatch, InvalidHeader
+
+SIGNATURE = b"EFI PART"
+HEADER_FORMAT = "<8sIIIIQQQQ16sQIII"
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+ENTRY_FORMAT = "<16s16sQQQ72s"
+
+
+@dataclass
+class Header:
+    revision: int
+    header_size: int
+    current_lba: int
+    backup_lba: int
+    first_usable_lba: int
+    last_usable_lba: int
+    disk_guid: uuid.UUID
+    entries_lba: int
+    entry_count: int
+    entry_size: int
+    entries_crc: int
+
+
+@dataclass
+class Partition:
+    type_guid: uuid.UUID
+    guid: uuid.UUID
+    first_lba: int
+    last_lba: int
+    attributes: int
+    name: str
+
+
+def parse_header(block):
+    fields = struct.unpack_from(HEADER_FORMAT, block)
+    (signature, revision, header_size, header_crc, _, current_lba, backup_lba,
+     first_usable_lba, last_usable_lba, disk_guid, entries_lba, entry_count,
+     entry_size, entries_crc) = fields
+    if signature != SIGNATURE:
+        raise InvalidHeader("signature", signature)
+    if header_size < HEADER_SIZE or header_size > len(block):
+        raise InvalidHeader("header_size", header_size)
+    raw = bytearray(block[:header_size])
+    raw[16:20] = b"\0\0\0\0"
+    actual = zlib.crc32(raw)
+    if actual != header_crc:
+        raise ChecksumMismatch("header", header_crc, actual)
+    return Header(revision, header_size, current_lba, backup_lba, first_usable_lba,
+                  last_usable_lba, uuid.UUID(bytes_le=disk_guid), entries_lba,
+                  entry_count, entry_size, entries_crc)
+
+
+def parse_entries(header, data):
+    actual = zlib.crc32(data)
+    if actual != header.entries_crc:
+        raise ChecksumMismatch("partition entries", header.entries_crc, actual)
+    partitions = []
+    for offset in range(0, header.entry_count * header.entry_size, header.entry_size):
+        type_guid, guid, first, last, attributes, name = struct.unpack_from(ENTRY_FORMAT, data, offset)
+        if type_guid == bytes(16):
+            continue
+        partitions.append(Partition(uuid.UUID(bytes_le=type_guid), uuid.UUID(bytes_le=guid), first, last,
+                                    attributes, name.decode("utf-16-le").rstrip("\0")))
+    return partitions
+
+
+def read_gpt(path, sector_size=512):
+    with open(path, "rb") as image:
+        image.seek(sector_size)
+        header = parse_header(image.read(sector_size))
+        image.seek(header.entries_lba * sector_size)
+        return parse_entries(header, image.read(header.entry_count * header.entry_size))
@@ -0,0 +1,16 @@
+import sys
+
+from gpt_parser import read_gpt
+
+
+def main(argv):
+    if len(argv) != 2:
+        print(f"usage: {argv[0]} <image>", file=sys.stderr)
+        return 1
+    for partition in read_gpt(argv[1]):
+        print(f"{partition.name:36} {partition.first_lba:>12} {partition.last_lba:>12}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,14 @@
+# Builds the sample configuration and reads the image back with verify_image
+include("${CMAKE_CURRENT_LIST_DIR}/sample_config.cmake")
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+write_sample_config("${WORK_DIR}/sample.json" "${WORK_DIR}/sample.img" ${SECTOR_SIZE})
+build_image("${WORK_DIR}/sample.json")
+
+execute_process(COMMAND "${VERIFY_IMAGE}" "${WORK_DIR}/sample.json" RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${WORK_DIR}/sample.img doesn't match its configuration")
+endif()
+
+file(REMOVE_RECURSE "${WORK_DIR}")
@@ -0,0 +1,22 @@
+# Two reproducible builds of the same inputs, a few seconds apart and to different outputs, must be
+# bit-identical: once stamped with the source modification times, once with SOURCE_DATE_EPOCH and a seed
+include("${CMAKE_CURRENT_LIST_DIR}/sample_config.cmake")
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+write_sample_config("${WORK_DIR}/first.json" "${WORK_DIR}/first.img" ${SECTOR_SIZE})
+write_sample_config("${WORK_DIR}/second.json" "${WORK_DIR}/second.img" ${SECTOR_SIZE})
+
+unset(ENV{SOURCE_DATE_EPOCH})
+build_image("${WORK_DIR}/first.json" --reproducible)
+execute_process(COMMAND "${CMAKE_COMMAND}" -E sleep 2)
+build_image("${WORK_DIR}/second.json" --reproducible)
+compare_images("${WORK_DIR}/first.img" "${WORK_DIR}/second.img")
+
+set(ENV{SOURCE_DATE_EPOCH} 1700000000)
+build_image("${WORK_DIR}/first.json" --seed ctest)
+execute_process(COMMAND "${CMAKE_COMMAND}" -E sleep 2)
+build_image("${WORK_DIR}/second.json" --seed ctest)
+compare_images("${WORK_DIR}/first.img" "${WORK_DIR}/second.img")
+
+file(REMOVE_RECURSE "${WORK_DIR}")
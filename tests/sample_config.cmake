@@ -0,0 +1,34 @@
+# Writes the sample configuration of the repository with its sources taken from DATA_DIR, the image
+# written to outputPath and the given sector size
+function(write_sample_config configPath outputPath sectorSize)
+    file(READ "${SAMPLE_CONFIG}" config)
+    string(JSON config SET "${config}" output "\"${outputPath}\"")
+    string(JSON config SET "${config}" sector_size "${sectorSize}")
+
+    string(JSON filesystemCount LENGTH "${config}" filesystems)
+    math(EXPR lastFilesystem "${filesystemCount} - 1")
+    foreach(i RANGE ${lastFilesystem})
+        string(JSON fileCount LENGTH "${config}" filesystems ${i} files)
+        math(EXPR lastFile "${fileCount} - 1")
+        foreach(j RANGE ${lastFile})
+            string(JSON source GET "${config}" filesystems ${i} files ${j} source)
+            string(JSON config SET "${config}" filesystems ${i} files ${j} source "\"${DATA_DIR}/${source}\"")
+        endforeach()
+    endforeach()
+
+    file(WRITE "${configPath}" "${config}")
+endfunction()
+
+function(build_image configPath)
+    execute_process(COMMAND "${IMAGE_CREATOR}" "${configPath}" ${ARGN} WORKING_DIRECTORY "${WORK_DIR}" RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "building ${configPath} failed: ${result}")
+    endif()
+endfunction()
+
+function(compare_images first second)
+    execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${first}" "${second}" RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${first} and ${second} differ")
+    endif()
+endfunction()
@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <cal_types.h>
+#include <crc32.hpp>
+#include <json.hpp>
+
+// Reads a built image back without any of the builder's code, apart from the CRC32, and checks it
+// against the configuration it was built from: both GPT headers and their CRCs, the sector size of
+// every FAT32 filesystem and the content of every listed file
+// Usage: verify_image <configuration>
+
+using json = nlohmann::json;
+
+#define GPT_HEADER_SIGNATURE "EFI PART"
+#define FAT_EOC 0x0FFFFFF8
+#define FAT_CLUSTER_MASK 0x0FFFFFFF
+#define DIR_ENTRY_SIZE 32
+#define ATTR_DIRECTORY 0x10
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_LONG_NAME 0x0F
+
+typedef struct
+{
+    std::string Name;
+    QWORD FirstLba;
+    QWORD LastLba;
+} Partition;
+
+typedef struct
+{
+    std::string Name; // Long name when there is one, upper case
+    std::string ShortName; // 8.3 with the dot, upper case
+    BYTE Attributes;
+    DWORD FirstCluster;
+    DWORD Size;
+} DirectoryEntry;
+
+static std::ifstream image;
+static DWORD sectorSize;
+static int failures = 0;
+
+static void fail(std::string const& message)
+{
+    std::cerr << "FAIL: " << message << std::endl;
+    failures++;
+}
+
+static std::vector<BYTE> readAt(QWORD offset, size_t length)
+{
+    std::vector<BYTE> data(length);
+    image.clear();
+    image.seekg(offset);
+    image.read(reinterpret_cast<char*>(data.data()), length);
+    if (static_cast<size_t>(image.gcount()) != length)
+        data.clear();
+    return data;
+}
+
+template <typename T>
+static T get(std::vector<BYTE> const& data, size_t offset)
+{
+    T value;
+    std::memcpy(&value, data.data() + offset, sizeof(T));
+    return value;
+}
+
+static std::string upper(std::string text)
+{
+    for (auto &c : text)
+        c = std::toupper(static_cast<unsigned char>(c));
+    return text;
+}
+
+static bool checkGptHeader(QWORD lba, QWORD expectedAlternate, std::vector<BYTE> &header, std::string const& which)
+{
+    header = readAt(lba * sectorSize, sectorSize);
+    if (header.empty() || std::memcmp(header.data(), GPT_HEADER_SIGNATURE, 8) != 0)
+    {
+        fail(which + " GPT header missing at LBA " + std::to_string(lba));
+        return false;
+    }
+
+    DWORD headerSize = get<DWORD>(header, 12);
+    std::vector<BYTE> zeroed(header.begin(), header.begin() + std::min<DWORD>(headerSize, sectorSize));
+    std::memset(zeroed.data() + 16, 0, sizeof(DWORD));
+    if (computeCrc32(zeroed.data(), static_cast<DWORD>(zeroed.size())) != get<DWORD>(header, 16))
+        fail(which + " GPT header CRC");
+    if (get<QWORD>(header, 24) != lba || get<QWORD>(header, 32) != expectedAlternate)
+        fail(which + " GPT header points at LBA " + std::to_string(get<QWORD>(header, 24)) + " and " + std::to_string(get<QWORD>(header, 32)));
+
+    DWORD entryCount = get<DWORD>(header, 80);
+    DWORD entrySize = get<DWORD>(header, 84);
+    std::vector<BYTE> entries = readAt(get<QWORD>(header, 72) * sectorSize, static_cast<size_t>(entryCount) * entrySize);
+    if (entries.empty() || computeCrc32(entries.data(), static_cast<DWORD>(entries.size())) != get<DWORD>(header, 88))
+        fail(which + " GPT partition entry CRC");
+    return true;
+}
+
+static std::vector<Partition> readPartitions(std::vector<BYTE> const& header)
+{
+    std::vector<Partition> partitions;
+    DWORD entryCount = get<DWORD>(header, 80);
+    DWORD entrySize = get<DWORD>(header, 84);
+    std::vector<BYTE> entries = readAt(get<QWORD>(header, 72) * sectorSize, static_cast<size_t>(entryCount) * entrySize);
+    for (DWORD i = 0; i < entryCount && !entries.empty(); i++)
+    {
+        BYTE const *entry = entries.data() + static_cast<size_t>(i) * entrySize;
+        if (std::all_of(entry, entry + 16, [](BYTE b) { return b == 0; }))
+            continue;
+
+        // Names in the tests are ASCII, the high bytes of the UTF-16 units are dropped
+        Partition partition;
+        for (size_t c = 56; c + 1 < 128 && (entry[c] || entry[c + 1]); c += 2)
+            partition.Name += static_cast<char>(entry[c]);
+        std::memcpy(&partition.FirstLba, entry + 32, sizeof(QWORD));
+        std::memcpy(&partition.LastLba, entry + 40, sizeof(QWORD));
+        partitions.push_back(partition);
+    }
+    return partitions;
+}
+
+class FatReader
+{
+    private:
+        QWORD partitionOffset;
+        DWORD clusterSize;
+        DWORD rootCluster;
+        QWORD dataOffset;
+        std::vector<DWORD> fat;
+
+    public:
+        bool open(Partition const& partition)
+        {
+            partitionOffset = partition.FirstLba * sectorSize;
+            std::vector<BYTE> bpb = readAt(partitionOffset, 512);
+            if (bpb.empty() || bpb[510] != 0x55 || bpb[511] != 0xAA || std::memcmp(bpb.data() + 82, "FAT32", 5) != 0)
+            {
+                fail(partition.Name + ": no FAT32 boot sector");
+                return false;
+            }
+
+            WORD bytesPerSector = get<WORD>(bpb, 11);
+            if (bytesPerSector != sectorSize)
+            {
+                fail(partition.Name + ": BPB_BytsPerSec is " + std::to_string(bytesPerSector) + ", the disk has " + std::to_string(sectorSize) + " byte sectors");
+                return false;
+            }
+
+            clusterSize = bpb[13] * bytesPerSector;
+            WORD reservedSectors = get<WORD>(bpb, 14);
+            BYTE fatCount = bpb[16];
+            DWORD fatSectors = get<DWORD>(bpb, 36);
+            rootCluster = get<DWORD>(bpb, 44);
+            dataOffset = partitionOffset + (reservedSectors + static_cast<QWORD>(fatCount) * fatSectors) * bytesPerSector;
+
+            std::vector<BYTE> fatBytes = readAt(partitionOffset + static_cast<QWORD>(reservedSectors) * bytesPerSector, static_cast<size_t>(fatSectors) * bytesPerSector);
+            std::vector<BYTE> secondFat = readAt(partitionOffset + (reservedSectors + static_cast<QWORD>(fatSectors)) * bytesPerSector, fatBytes.size());
+            if (fatCount > 1 && fatBytes != secondFat)
+                fail(partition.Name + ": the FAT copies differ");
+            fat.resize(fatBytes.size() / sizeof(DWORD));
+            std::memcpy(fat.data(), fatBytes.data(), fat.size() * sizeof(DWORD));
+            return true;
+        }
+
+        std::vector<BYTE> readChain(DWORD cluster, std::optional<DWORD> size)
+        {
+            std::vector<BYTE> data;
+            while (cluster >= 2 && cluster < FAT_EOC && cluster < fat.size() && (!size.has_value() || data.size() < size.value()))
+            {
+                std::vector<BYTE> clusterData = readAt(dataOffset + static_cast<QWORD>(cluster - 2) * clusterSize, clusterSize);
+                data.insert(data.end(), clusterData.begin(), clusterData.end());
+                cluster = fat[cluster] & FAT_CLUSTER_MASK;
+            }
+            if (size.has_value())
+                data.resize(std::min<size_t>(data.size(), size.value()));
+            return data;
+        }
+
+        std::vector<DirectoryEntry> readDirectory(DWORD cluster)
+        {
+            std::vector<DirectoryEntry> entries;
+            std::vector<BYTE> data = readChain(cluster, {});
+            std::string longName;
+            for (size_t offset = 0; offset + DIR_ENTRY_SIZE <= data.size(); offset += DIR_ENTRY_SIZE)
+            {
+                BYTE const *raw = data.data() + offset;
+                if (raw[0] == 0)
+                    break;
+                if (raw[0] == 0xE5)
+                {
+                    longName.clear();
+                    continue;
+                }
+                if (raw[11] == ATTR_LONG_NAME)
+                {
+                    // Slices come last first, the names in the tests are ASCII
+                    std::string slice;
+                    for (size_t c : { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 })
+                    {
+                        if (!raw[c] && !raw[c + 1])
+                            break;
+                        slice += static_cast<char>(raw[c]);
+                    }
+                    longName = slice + longName;
+                    continue;
+                }
+
+                DirectoryEntry entry;
+                std::string base(reinterpret_cast<char const*>(raw), 8);
+                std::string extension(reinterpret_cast<char const*>(raw) + 8, 3);
+                base.erase(base.find_last_not_of(' ') + 1);
+                extension.erase(extension.find_last_not_of(' ') + 1);
+                entry.ShortName = extension.empty() ? base : base + "." + extension;
+                entry.Name = upper(longName.empty() ? entry.ShortName : longName);
+                entry.Attributes = raw[11];
+                entry.FirstCluster = static_cast<DWORD>(raw[21] << 8 | raw[20]) << 16 | static_cast<DWORD>(raw[27] << 8 | raw[26]);
+                std::memcpy(&entry.Size, raw + 28, sizeof(DWORD));
+                longName.clear();
+                if (!(entry.Attributes & ATTR_VOLUME_ID))
+                    entries.push_back(entry);
+            }
+            return entries;
+        }
+
+        std::optional<DirectoryEntry> find(std::string const& path)
+        {
+            DirectoryEntry current = { "/", "/", ATTR_DIRECTORY, rootCluster, 0 };
+            for (size_t start = 1; start <= path.length();)
+            {
+                size_t end = std::min(path.find('/', start), path.length());
+                std::string name = upper(path.substr(start, end - start));
+                start = end + 1;
+                if (!(current.Attributes & ATTR_DIRECTORY))
+                    return {};
+
+                std::vector<DirectoryEntry> entries = readDirectory(current.FirstCluster);
+                auto it = std::find_if(entries.begin(), entries.end(), [&name](DirectoryEntry const& entry) { return entry.Name == name || entry.ShortName == name; });
+                if (it == entries.end())
+                    return {};
+                current = *it;
+            }
+            return current;
+        }
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <configuration>" << std::endl;
+        return 2;
+    }
+
+    std::ifstream configFile(argv[1]);
+    json config = json::parse(configFile, nullptr, false);
+    if (!config.is_object())
+    {
+        std::cerr << "can't read " << argv[1] << std::endl;
+        return 2;
+    }
+
+    sectorSize = config.value("sector_size", 512U);
+    std::string output = config["output"].get<std::string>();
+    image.open(output, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!image.is_open())
+    {
+        std::cerr << "can't open " << output << std::endl;
+        return 2;
+    }
+    QWORD imageSize = image.tellg();
+    QWORD lastLba = imageSize / sectorSize - 1;
+    if (imageSize % sectorSize)
+        fail("the image size isn't a multiple of the sector size");
+
+    std::vector<BYTE> primary, backup;
+    if (!checkGptHeader(1, lastLba, primary, "primary") || !checkGptHeader(lastLba, 1, backup, "backup"))
+        return 1;
+    std::vector<Partition> partitions = readPartitions(primary);
+    if (partitions.size() != config["partitions"].size())
+        fail(std::to_string(partitions.size()) + " partitions, the configuration lists " + std::to_string(config["partitions"].size()));
+
+    for (auto const& filesystem : config["filesystems"])
+    {
+        std::string name = filesystem["partition"].get<std::string>();
+        auto partition = std::find_if(partitions.begin(), partitions.end(), [&name](Partition const& p) { return p.Name == name; });
+        FatReader reader;
+        if (partition == partitions.end())
+        {
+            fail(name + ": no such partition");
+            continue;
+        }
+        if (!reader.open(*partition))
+            continue;
+
+        for (auto const& directory : filesystem.value("directories", json::array()))
+        {
+            auto entry = reader.find(directory.get<std::string>());
+            if (!entry.has_value() || !(entry->Attributes & ATTR_DIRECTORY))
+                fail(name + ": directory " + directory.get<std::string>() + " is missing");
+        }
+
+        for (auto const& file : filesystem.value("files", json::array()))
+        {
+            std::string destination = file["destination"].get<std::string>();
+            std::ifstream source(file["source"].get<std::string>(), std::ios::in | std::ios::binary);
+            std::vector<BYTE> expected((std::istreambuf_iterator<char>(source)), std::istreambuf_iterator<char>());
+            auto entry = reader.find(destination);
+            if (!entry.has_value() || (entry->Attributes & ATTR_DIRECTORY))
+                fail(name + ": file " + destination + " is missing");
+            else if (entry->Size != expected.size() || reader.readChain(entry->FirstCluster, entry->Size) != expected)
+                fail(name + ": " + destination + " doesn't hold its source");
+        }
+    }
+
+    if (!failures)
+        std::cout << output << ": " << partitions.size() << " partitions, " << sectorSize << " byte sectors, OK" << std::endl;
+    return failures ? 1 : 0;
+}